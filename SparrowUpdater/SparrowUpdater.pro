@@ -11,10 +11,24 @@ DESTDIR = $$lib_dir
 
 SOURCES += \
     basicupdater.cpp \
+    binarypatch.cpp \
+    instancelock.cpp \
+    localtransport.cpp \
+    manifest.cpp \
+    rollbackstore.cpp \
     updaterclient.cpp \
+    updatertransport.cpp \
+    verificationsnapshot.cpp \
     versionupdater.cpp
 
 HEADERS += \
     basicupdater.h \
+    binarypatch.h \
+    instancelock.h \
+    localtransport.h \
+    manifest.h \
+    rollbackstore.h \
     updaterclient.h \
+    updatertransport.h \
+    verificationsnapshot.h \
     versionupdater.h
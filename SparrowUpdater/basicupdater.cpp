@@ -13,18 +13,24 @@ BasicUpdater::BasicUpdater(QObject *parent, QString baseUrl)
         auto progress = _updater->getTotalProgress();
         emit progressChanged(progress.first, progress.second);
     });
-}
-
-void BasicUpdater::updateApplication()
-{
-    emit progressChanged(0,0);
     
-    _updater->getOnlineVersionInfo();
+    // another instance of the app is updating the app folder, its progress comes through progressChanged
+    connect(_updater, &VersionUpdater::otherInstanceUpdating, this, [this](){
+        emit progressChanged(0,0);
+    });
+    connect(_updater, &VersionUpdater::otherInstanceFinished, this, [this](bool succeeded){
+        if(succeeded)
+            updateApplication(); // the files are checked again, they are usually up to date
+        else
+            emit failure({tr("Another instance of the application failed to update it")});
+    });
     
     connect(_updater, &VersionUpdater::onlineVersionReceived, this, [this](QString version){
-        if(!_updater->checkFiles())
-            _updater->downloadFiles();
-        else
+        _updater->checkAndDownloadFiles();
+    });
+    
+    connect(_updater, &VersionUpdater::filesChecked, this, [this](bool filesOk){
+        if(filesOk)
             emit success();
     });
     
@@ -39,3 +45,10 @@ void BasicUpdater::updateApplication()
             emit success();
     });
 }
+
+void BasicUpdater::updateApplication()
+{
+    emit progressChanged(0,0);
+    
+    _updater->getOnlineVersionInfo();
+}
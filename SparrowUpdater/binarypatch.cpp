@@ -0,0 +1,144 @@
+#include "binarypatch.h"
+
+#include <QDataStream>
+#include <QHash>
+#include <cstring>
+#include <limits>
+
+static const quint32 PatchMagic = 0x53504431; // "SPD1"
+static const int BlockSize = 32;
+static const quint32 HashBase = 257;
+
+enum PatchOp : quint8 { CopyOp, InsertOp };
+
+// =============== UTILITY ===============
+
+static quint32 blockHash(const uchar* block)
+{
+    quint32 hash = 0;
+    for(int i=0; i<BlockSize; ++i)
+        hash = hash * HashBase + block[i];
+    return hash;
+}
+
+static void writeInsert(QDataStream& stream, const uchar* bytes, qint64 length)
+{
+    if(length <= 0)
+        return;
+    stream << quint8(InsertOp) << length;
+    stream.writeRawData(reinterpret_cast<const char*>(bytes), int(length));
+}
+
+static void writeCopy(QDataStream& stream, qint64 offset, qint64 length)
+{
+    stream << quint8(CopyOp) << offset << length;
+}
+
+// =============== BinaryPatch class ===============
+
+QByteArray BinaryPatch::generate(const QByteArray& source, const QByteArray& target)
+{
+    const uchar* src = reinterpret_cast<const uchar*>(source.constData());
+    const uchar* dst = reinterpret_cast<const uchar*>(target.constData());
+    qint64 srcSize = source.size();
+    qint64 dstSize = target.size();
+
+    // first offset of every aligned block of the source
+    QHash<quint32, qint64> blocks;
+    blocks.reserve(int(srcSize / BlockSize));
+    for(qint64 offset = 0; offset + BlockSize <= srcSize; offset += BlockSize)
+    {
+        quint32 hash = blockHash(src + offset);
+        if(!blocks.contains(hash))
+            blocks.insert(hash, offset);
+    }
+    quint32 power = 1; // HashBase^(BlockSize-1), to roll the first byte out of the hash
+    for(int i=1; i<BlockSize; ++i)
+        power *= HashBase;
+
+    QByteArray ops;
+    QDataStream stream(&ops, QIODevice::WriteOnly);
+    stream << PatchMagic << quint64(dstSize);
+
+    qint64 literalStart = 0;
+    qint64 pos = 0;
+    quint32 hash = dstSize >= BlockSize ? blockHash(dst) : 0;
+    while(pos + BlockSize <= dstSize)
+    {
+        auto block = blocks.constFind(hash);
+        if(block != blocks.cend() && std::memcmp(src + block.value(), dst + pos, BlockSize) == 0)
+        {
+            // the match is extended backward over the pending literal bytes, then forward
+            qint64 srcPos = block.value();
+            qint64 length = BlockSize;
+            while(srcPos > 0 && pos > literalStart && src[srcPos - 1] == dst[pos - 1])
+            {
+                --srcPos;
+                --pos;
+                ++length;
+            }
+            while(srcPos + length < srcSize && pos + length < dstSize && src[srcPos + length] == dst[pos + length])
+                ++length;
+
+            writeInsert(stream, dst + literalStart, pos - literalStart);
+            writeCopy(stream, srcPos, length);
+            pos += length;
+            literalStart = pos;
+            if(pos + BlockSize <= dstSize)
+                hash = blockHash(dst + pos);
+        }
+        else
+        {
+            if(pos + BlockSize < dstSize)
+                hash = (hash - dst[pos] * power) * HashBase + dst[pos + BlockSize];
+            ++pos;
+        }
+    }
+    writeInsert(stream, dst + literalStart, dstSize - literalStart);
+
+    return qCompress(ops, 9);
+}
+
+bool BinaryPatch::apply(const QByteArray& source, const QByteArray& patch, QByteArray& target)
+{
+    QByteArray ops = qUncompress(patch);
+    QDataStream stream(ops);
+    quint32 magic = 0;
+    quint64 targetSize = 0;
+    stream >> magic >> targetSize;
+    if(stream.status() != QDataStream::Ok || magic != PatchMagic || targetSize > quint64(std::numeric_limits<int>::max()))
+        return false;
+
+    target.clear();
+    target.reserve(int(targetSize));
+    while(!stream.atEnd())
+    {
+        quint8 op = 0;
+        qint64 offset = 0;
+        qint64 length = 0;
+        stream >> op;
+        if(op == CopyOp)
+        {
+            stream >> offset >> length;
+            if(offset < 0 || length < 0 || offset > source.size() || length > source.size() - offset)
+                return false;
+            target.append(source.constData() + offset, int(length));
+        }
+        else if(op == InsertOp)
+        {
+            stream >> length;
+            if(length < 0 || length > ops.size())
+                return false;
+            QByteArray bytes(int(length), Qt::Uninitialized);
+            if(stream.readRawData(bytes.data(), int(length)) != length)
+                return false;
+            target.append(bytes);
+        }
+        else
+            return false;
+
+        if(stream.status() != QDataStream::Ok || quint64(target.size()) > targetSize)
+            return false;
+    }
+    return quint64(target.size()) == targetSize;
+}
@@ -0,0 +1,23 @@
+#ifndef BINARYPATCH_H
+#define BINARYPATCH_H
+
+#include <QByteArray>
+
+/**
+ * @brief The BinaryPatch class builds and applies binary patches between two versions of a file
+ *
+ * the patch is a list of copies from the source and of inserted bytes, found by matching the blocks
+ * of the source in the target with a rolling hash, then compressed with zlib (qCompress).
+ * it only needs Qt's core module, and stays small for exe and dll files rebuilt with few changes
+ */
+class BinaryPatch
+{
+public:
+    /// builds the patch turning source into target
+    static QByteArray generate(const QByteArray& source, const QByteArray& target);
+
+    /// rebuilds target from source and patch, returns false if the patch is corrupted or doesn't apply to source
+    static bool apply(const QByteArray& source, const QByteArray& patch, QByteArray& target);
+};
+
+#endif // BINARYPATCH_H
@@ -0,0 +1,123 @@
+#include "instancelock.h"
+
+#include <QCoreApplication>
+#include <QJsonDocument>
+#include <QVariantMap>
+#include <QSaveFile>
+#include <QFileInfo>
+#include <QDateTime>
+#include <QTimer>
+
+const qint64 updateScriptTimeout = 600000; // ms, a script still there after that was killed, or is stuck on a locked file
+const QStringList succeededStates = {"upToDate", "updated", "staged", "rolledBack"};
+const QStringList finishedStates = succeededStates + QStringList{"failed", "canceled", "stopped"};
+
+// =============== InstanceLock class ===============
+
+InstanceLock::InstanceLock(QObject* parent, const QString& rootDir, const QString& lockFile, const QString& statusFile, const QString& updateScriptFile)
+:   QObject(parent)
+,   _rootDir(rootDir + '/')
+,   _statusFile(statusFile)
+,   _updateScriptFile(updateScriptFile)
+,   _lock(rootDir + '/' + lockFile)
+,   _followTimer(nullptr)
+,   _following(false)
+,   _restarting(false)
+,   _ownerPid(0)
+,   _sharedProgress(0, 0)
+{
+    _lock.setStaleLockTime(0); // only stale if the owner process is gone, updates can take long
+}
+
+bool InstanceLock::acquire()
+{
+    if(_restarting)
+        return false; // the app quits, the update script takes over
+    if(_lock.isLocked() || (!updateScriptRunning() && _lock.tryLock(0)))
+        return true;
+
+    // following the progress of the instance holding the lock through its status file
+    QString hostname, appname;
+    if(!_lock.getLockInfo(&_ownerPid, &hostname, &appname))
+        _ownerPid = 0; // the app that started the update script is gone, its last status is the one to follow
+    _following = true;
+    _sharedProgress = {0, 0};
+    if(!_followTimer)
+    {
+        _followTimer = new QTimer(this);
+        connect(_followTimer, &QTimer::timeout, this, &InstanceLock::readStatus);
+    }
+    _followTimer->start(500);
+    emit otherInstanceUpdating();
+    return false;
+}
+
+void InstanceLock::release(const QString& state, const QString& version, std::pair<qint64,qint64> progress)
+{
+    if(!_lock.isLocked())
+        return;
+    writeStatus(state, version, progress);
+    _lock.unlock();
+}
+
+void InstanceLock::writeStatus(const QString& state, const QString& version, std::pair<qint64,qint64> progress, bool throttled)
+{
+    // the other instances poll the status file, a write per progress step is useless
+    if(throttled && _statusTimer.isValid() && _statusTimer.elapsed() <= 250)
+        return;
+    QVariantMap status;
+    status["pid"] = qApp->applicationPid();
+    status["state"] = state;
+    status["version"] = version;
+    status["bytesReceived"] = progress.first;
+    status["bytesTotal"] = progress.second;
+
+    // replaced at once, so that readers never see a partial file
+    QByteArray json = QJsonDocument::fromVariant(status).toJson();
+    QSaveFile file(_rootDir + _statusFile);
+    if(file.open(QFile::WriteOnly) && file.write(json) == json.size())
+        file.commit();
+    _statusTimer.start();
+}
+
+void InstanceLock::stopFollowing()
+{
+    if(!_following)
+        return;
+    _followTimer->stop(); // the other instance goes on without us
+    _following = false;
+}
+
+bool InstanceLock::updateScriptRunning() const
+{
+    // the lock file can't outlive the app that starts the update script, the script deletes itself once the exe files are copied
+    QFileInfo script(_rootDir + _updateScriptFile);
+    return script.exists() && script.lastModified().msecsTo(QDateTime::currentDateTime()) < updateScriptTimeout;
+}
+
+void InstanceLock::readStatus()
+{
+    QFile file(_rootDir + _statusFile);
+    QVariantMap status = file.open(QFile::ReadOnly) ? QJsonDocument::fromJson(file.readAll()).toVariant().toMap() : QVariantMap();
+    if(_ownerPid != 0 && status["pid"].toLongLong() != _ownerPid)
+        status.clear(); // left by a previous owner, the current one didn't write it yet
+
+    std::pair<qint64,qint64> progress = {status["bytesReceived"].toLongLong(), status["bytesTotal"].toLongLong()};
+    if(progress != _sharedProgress)
+    {
+        _sharedProgress = progress;
+        emit sharedProgressChanged();
+    }
+
+    QString state = status["state"].toString();
+    if(!finishedStates.contains(state))
+    {
+        if(updateScriptRunning() || !_lock.tryLock(0))
+            return; // still running
+        _lock.unlock();
+        state = state == "restarting" ? "updated" : "stopped"; // the update script is done, or the owner is gone without a word
+    }
+    _followTimer->stop();
+    _following = false;
+    emit otherInstanceFinished(succeededStates.contains(state));
+}
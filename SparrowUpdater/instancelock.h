@@ -0,0 +1,68 @@
+#ifndef INSTANCELOCK_H
+#define INSTANCELOCK_H
+
+#include <QObject>
+#include <QLockFile>
+#include <QElapsedTimer>
+#include <utility>
+
+class QTimer;
+
+/**
+ * @brief The InstanceLock class lets a single instance of the app update the app folder at a time
+ *
+ * the holder of the lock file publishes its state and progress in a status file, the other instances follow it.
+ * when an update script copies the exe files, the lock is held until the app quits, then the other instances
+ * wait for the script to delete itself
+ */
+class InstanceLock : public QObject
+{
+    Q_OBJECT
+public:
+    /// the file names are relative to rootDir
+    InstanceLock(QObject* parent, const QString& rootDir, const QString& lockFile, const QString& statusFile, const QString& updateScriptFile);
+
+    /**
+     * returns true if this instance holds the lock, taking it if it is free.
+     * otherwise the instance holding it is followed through the status file until it is done
+     */
+    bool acquire();
+    bool isLocked() const { return _lock.isLocked(); }
+
+    /// writes the status one last time and unlocks, does nothing if the lock isn't held
+    void release(const QString& state, const QString& version, std::pair<qint64,qint64> progress);
+
+    /// replaces the status file at once, throttled writes are skipped if the last write is more recent than 250ms
+    void writeStatus(const QString& state, const QString& version, std::pair<qint64,qint64> progress, bool throttled = false);
+
+    /// the update script was started : the lock is held until the app quits, and acquire() fails until then
+    void holdForUpdateScript() { _restarting = true; }
+    bool isRestarting() const { return _restarting; }
+
+    bool isFollowing() const { return _following; }
+    void stopFollowing();
+    /// progress of the followed instance, as published in its status file
+    std::pair<qint64,qint64> sharedProgress() const { return _sharedProgress; }
+
+signals:
+    void otherInstanceUpdating();
+    void sharedProgressChanged();
+    void otherInstanceFinished(bool succeeded);
+
+private:
+    bool updateScriptRunning() const;
+    void readStatus();
+
+    QString                  _rootDir;
+    QString                  _statusFile;
+    QString                  _updateScriptFile;
+    QLockFile                _lock;
+    QElapsedTimer            _statusTimer;    // since the last status write
+    QTimer*                  _followTimer;    // polls the status file of the instance holding the lock
+    bool                     _following;
+    bool                     _restarting;     // the update script was started, the app is expected to quit
+    qint64                   _ownerPid;
+    std::pair<qint64,qint64> _sharedProgress;
+};
+
+#endif // INSTANCELOCK_H
@@ -0,0 +1,249 @@
+#include "localtransport.h"
+
+#include <QThreadPool>
+#include <QRunnable>
+#include <QPointer>
+#include <QFile>
+#include <QFileInfo>
+#include <QDir>
+#include <QCryptographicHash>
+#include <QDateTime>
+#include <QLocale>
+#include <atomic>
+#include <memory>
+#include <functional>
+
+#ifdef Q_OS_LINUX
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <linux/fs.h>
+#include <unistd.h>
+#include <cerrno>
+#endif
+
+#ifdef Q_OS_WIN
+#define NOMINMAX
+#include <windows.h>
+#endif
+
+static const qint64 ChunkSize = 8 << 20; // progress and cancellation granularity
+
+// =============== UTILITY ===============
+
+typedef std::function<void(qint64,qint64)> ProgressCallback;
+
+#ifdef Q_OS_LINUX
+// copies in kernel space, returns false if nothing could be copied this way, so that the caller falls back
+static bool kernelCopy(int inFd, int outFd, qint64 size, const std::atomic<bool>& canceled, const ProgressCallback& progress, qint64& copied)
+{
+    // a reflink shares the blocks of the source, on filesystems supporting it (btrfs, xfs...)
+    if(ioctl(outFd, FICLONE, inFd) == 0)
+    {
+        copied = size;
+        progress(copied, size);
+        return true;
+    }
+
+    bool useSendfile = false;
+    while(copied < size && !canceled)
+    {
+        size_t chunk = size_t(qMin(ChunkSize, size - copied));
+        ssize_t n = useSendfile ? sendfile(outFd, inFd, nullptr, chunk)
+                                : copy_file_range(inFd, nullptr, outFd, nullptr, chunk, 0);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n < 0 && !useSendfile && copied == 0
+        && (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP))
+        {
+            useSendfile = true; // cross filesystem copies need a recent kernel
+            continue;
+        }
+        if(n <= 0)
+            break;
+        copied += n;
+        progress(copied, size);
+    }
+    return copied > 0 || size == 0;
+}
+#endif
+
+#ifdef Q_OS_WIN
+struct CopyContext
+{
+    const std::atomic<bool>* canceled;
+    const ProgressCallback*  progress;
+};
+
+static DWORD CALLBACK copyProgress(LARGE_INTEGER totalFileSize, LARGE_INTEGER totalBytesTransferred, LARGE_INTEGER, LARGE_INTEGER,
+                                   DWORD, DWORD, HANDLE, HANDLE, LPVOID data)
+{
+    const CopyContext* context = static_cast<const CopyContext*>(data);
+    if(*context->canceled)
+        return PROGRESS_CANCEL;
+    (*context->progress)(totalBytesTransferred.QuadPart, totalFileSize.QuadPart);
+    return PROGRESS_CONTINUE;
+}
+#endif
+
+static bool copyFile(const QString& source, const QString& target, const std::atomic<bool>& canceled, const ProgressCallback& progress, QString& error)
+{
+#ifdef Q_OS_WIN
+    // the system copy is offloaded to the server on SMB shares (and to the storage with ODX), and clones the blocks on ReFS
+    CopyContext context = {&canceled, &progress};
+    if(QDir().mkpath(QFileInfo(target).path())
+    && CopyFileExW(reinterpret_cast<LPCWSTR>(QDir::toNativeSeparators(source).utf16()),
+                   reinterpret_cast<LPCWSTR>(QDir::toNativeSeparators(target).utf16()), copyProgress, &context, nullptr, 0))
+        return true;
+    if(canceled)
+        return false;
+    // the portable copy below reports the error
+#endif
+    QFile in(source);
+    QFile out(target);
+    if(!in.open(QFile::ReadOnly))
+    {
+        error = QString("Can't open file for reading : %1").arg(source);
+        return false;
+    }
+    if(!QDir().mkpath(QFileInfo(target).path()) || !out.open(QFile::WriteOnly | QFile::Truncate))
+    {
+        error = QString("Can't open file for writing : %1").arg(target);
+        return false;
+    }
+
+    qint64 size = in.size();
+    qint64 copied = 0;
+#ifdef Q_OS_LINUX
+    if(!kernelCopy(in.handle(), out.handle(), size, canceled, progress, copied))
+        copied = 0; // the portable copy below starts over
+    in.seek(copied);
+    out.seek(copied);
+#endif
+    while(copied < size && !canceled)
+    {
+        QByteArray chunk = in.read(qMin(ChunkSize, size - copied));
+        if(chunk.isEmpty() || out.write(chunk) != chunk.size())
+            break;
+        copied += chunk.size();
+        progress(copied, size);
+    }
+
+    if(copied != size && !canceled)
+        error = QString("Failed to copy %1 bytes to file : %2").arg(size).arg(target);
+    return copied == size;
+}
+
+static QByteArray hashFile(const QString& path)
+{
+    QFile file(path);
+    QCryptographicHash hashFunc(QCryptographicHash::Sha1);
+    if(!file.open(QFile::ReadOnly) || !hashFunc.addData(&file))
+        return QByteArray();
+    return hashFunc.result();
+}
+
+// same form as http validators, from the size and modification time of the file
+static CacheValidators fileValidators(const QFileInfo& info)
+{
+    QDateTime modified = info.lastModified().toUTC();
+    return {'"' + QByteArray::number(modified.toMSecsSinceEpoch(), 16) + '-' + QByteArray::number(info.size(), 16) + '"',
+            QLocale::c().toString(modified, "ddd, dd MMM yyyy hh:mm:ss 'GMT'").toLatin1()};
+}
+
+// reads or copies one file in a worker thread, and reports to the reply through the transport, which outlives the workers
+class LocalTransfer : public QRunnable
+{
+public:
+    LocalTransfer(QObject* transport, TransportReply* reply, const QString& source, const QString& target,
+                  const CacheValidators& validators, std::shared_ptr<std::atomic<bool>> canceled)
+    :   _transport(transport), _reply(reply), _source(source), _target(target), _validators(validators), _canceled(canceled) {}
+
+    void run() override
+    {
+        TransportReply::Error error = TransportReply::NoError;
+        QString errorString;
+        QByteArray data;
+        QByteArray hash;
+        QFileInfo info(_source);
+        CacheValidators validators = fileValidators(info);
+        bool notModified = !_validators.etag.isEmpty() && _validators.etag == validators.etag;
+        if(!info.isFile())
+        {
+            error = TransportReply::PermanentError;
+            errorString = QString("File not found : %1").arg(_source);
+        }
+        else if(notModified)
+        {
+            // nothing to read
+        }
+        else if(_target.isEmpty())
+        {
+            QFile file(_source);
+            if(file.open(QFile::ReadOnly))
+                data = file.readAll();
+            if(data.size() != file.size())
+            {
+                error = TransportReply::TransientError; // shares can fail for a moment
+                errorString = QString("Can't read file : %1").arg(_source);
+            }
+        }
+        else
+        {
+            QPointer<TransportReply> reply = _reply;
+            QObject* transport = _transport;
+            ProgressCallback progress = [reply, transport](qint64 bytesReceived, qint64 bytesTotal){
+                QMetaObject::invokeMethod(transport, [=](){ if(reply) reply->setProgress(bytesReceived, bytesTotal); }, Qt::QueuedConnection);
+            };
+            if(copyFile(_source, _target, *_canceled, progress, errorString))
+                hash = hashFile(_target);
+            else
+                error = TransportReply::TransientError;
+        }
+        if(*_canceled)
+        {
+            error = TransportReply::CanceledError;
+            errorString = QString("Operation canceled");
+        }
+
+        QPointer<TransportReply> reply = _reply;
+        QMetaObject::invokeMethod(_transport, [=](){
+            if(!reply)
+                return;
+            reply->setValidators(validators, notModified);
+            reply->finish(error, errorString, data, hash);
+        }, Qt::QueuedConnection);
+    }
+
+private:
+    QObject*                           _transport;
+    QPointer<TransportReply>           _reply;
+    QString                            _source;
+    QString                            _target;
+    CacheValidators                    _validators;
+    std::shared_ptr<std::atomic<bool>> _canceled;
+};
+
+// =============== LocalTransport class ===============
+
+LocalTransport::LocalTransport(QObject* parent, const QString& rootDir)
+:   UpdaterTransport(parent)
+,   _rootDir(rootDir + '/')
+,   _pool(new QThreadPool(this))
+{
+    _pool->setMaxThreadCount(4); // enough to saturate a disk or a share
+}
+
+LocalTransport::~LocalTransport()
+{
+    _pool->clear();
+    _pool->waitForDone();
+}
+
+TransportReply* LocalTransport::get(const QString& filename, const QString& dstPath, const CacheValidators& validators)
+{
+    TransportReply* reply = new TransportReply(this);
+    auto canceled = std::make_shared<std::atomic<bool>>(false);
+    connect(reply, &TransportReply::abortRequested, reply, [canceled](){ *canceled = true; });
+    _pool->start(new LocalTransfer(this, reply, _rootDir + filename, dstPath, validators, canceled));
+    return reply;
+}
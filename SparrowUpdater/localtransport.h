@@ -0,0 +1,30 @@
+#ifndef LOCALTRANSPORT_H
+#define LOCALTRANSPORT_H
+
+#include "updatertransport.h"
+
+class QThreadPool;
+
+/**
+ * @brief The LocalTransport class reads the update server from a local folder (mounted share, usb drive...)
+ *
+ * files are copied in worker threads straight to their destination, on windows by CopyFileEx (offloaded to the server
+ * on SMB shares, block cloning on ReFS), on linux without going through user space (reflink, then copy_file_range,
+ * then sendfile), elsewhere by chunks.
+ * it is also a fast, network-free server for testing
+ */
+class LocalTransport : public UpdaterTransport
+{
+    Q_OBJECT
+public:
+    LocalTransport(QObject* parent, const QString& rootDir);
+    ~LocalTransport() override;
+
+    TransportReply* get(const QString& filename, const QString& dstPath = QString(), const CacheValidators& validators = CacheValidators()) override;
+
+private:
+    QString      _rootDir;
+    QThreadPool* _pool;
+};
+
+#endif // LOCALTRANSPORT_H
@@ -0,0 +1,327 @@
+#include "manifest.h"
+
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QJsonArray>
+#include <QHash>
+#include <QFile>
+#include <QCryptographicHash>
+#include <cstring>
+#include <algorithm>
+#include <limits>
+
+// =============== UTILITY ===============
+
+static QString categoryName(Manifest::Kind kind)
+{
+    return kind == Manifest::Exe ? "exe" : "data";
+}
+
+// returns false if a path can't be stored
+static bool readCategory(Manifest& manifest, const QJsonObject& map, Manifest::Kind kind, QSet<QString>* insertedFiles = nullptr)
+{
+    QString category = categoryName(kind);
+    QJsonArray files  = map.value(category + "Files").toArray();
+    QJsonArray hashes = map.value(category + "Hashs").toArray();
+    QJsonArray sizes  = map.value(category + "FileSizes").toArray();
+    for(int i=0; i<files.size() && i<hashes.size() && i<sizes.size(); ++i)
+    {
+        QString file = files[i].toString();
+        if(manifest.insert(file, kind, QByteArray::fromBase64(hashes[i].toString().toLatin1()), qint64(sizes[i].toDouble())) < 0)
+            return false;
+        if(insertedFiles)
+            insertedFiles->insert(file);
+    }
+    return true;
+}
+
+static void readPatches(Manifest& manifest, const QJsonObject& patches)
+{
+    for(auto it = patches.begin(); it != patches.end(); ++it)
+    {
+        QList<Manifest::Patch> filePatches;
+        for(QJsonValue value : it.value().toArray())
+        {
+            QJsonObject patch = value.toObject();
+            filePatches.append({QByteArray::fromBase64(patch.value("source").toString().toLatin1()),
+                                patch.value("file").toString(), qint64(patch.value("size").toDouble())});
+        }
+        manifest.setPatches(it.key(), filePatches);
+    }
+}
+
+static void readComponents(Manifest& manifest, const QJsonObject& components)
+{
+    for(auto it = components.begin(); it != components.end(); ++it)
+    {
+        QJsonObject component = it.value().toObject();
+        QStringList paths;
+        for(QJsonValue path : component.value("paths").toArray())
+            paths << path.toString();
+        manifest.setComponent(it.key(), {component.value("file").toString(), paths,
+                                         QByteArray::fromBase64(component.value("hash").toString().toLatin1())});
+    }
+}
+
+// =============== Manifest class ===============
+
+bool Manifest::fromJson(const QByteArray& versionJson, QString* error)
+{
+    clear();
+    QJsonParseError jsonError;
+    QJsonDocument doc = QJsonDocument::fromJson(versionJson, &jsonError);
+    if(jsonError.error != QJsonParseError::NoError || !doc.isObject())
+    {
+        if(error)
+            *error = jsonError.errorString();
+        return false;
+    }
+
+    QJsonObject map = doc.object();
+    _version = map.value("version").toString();
+    reserve(map.value("dataFiles").toArray().size() + map.value("exeFiles").toArray().size());
+    if(!readCategory(*this, map, Data) || !readCategory(*this, map, Exe))
+    {
+        if(error)
+            *error = QString("File path too long");
+        clear();
+        return false;
+    }
+    readPatches(*this, map.value("patches").toObject());
+    readComponents(*this, map.value("components").toObject());
+    return true;
+}
+
+QByteArray Manifest::toJson() const
+{
+    QJsonObject map;
+    map["version"] = _version;
+    for(Kind category : {Data, Exe})
+    {
+        QJsonArray files, hashes, sizes;
+        for(int i=0; i<count(); ++i)
+        {
+            if(kind(i) != category)
+                continue;
+            files.append(path(i));
+            hashes.append(QString::fromLatin1(digest(i).toBase64()));
+            sizes.append(double(fileSize(i)));
+        }
+        map[categoryName(category) + "Files"] = files;
+        map[categoryName(category) + "Hashs"] = hashes;
+        map[categoryName(category) + "FileSizes"] = sizes;
+    }
+    if(!_patches.isEmpty())
+    {
+        QJsonObject patches;
+        for(auto it = _patches.cbegin(); it != _patches.cend(); ++it)
+        {
+            QJsonArray filePatches;
+            for(const Patch& patch : it.value())
+                filePatches.append(QJsonObject{{"source", QString::fromLatin1(patch.source.toBase64())},
+                                               {"file", patch.file}, {"size", double(patch.size)}});
+            patches[it.key()] = filePatches;
+        }
+        map["patches"] = patches;
+    }
+    if(!_components.isEmpty())
+    {
+        QJsonObject components;
+        for(auto it = _components.cbegin(); it != _components.cend(); ++it)
+            components[it.key()] = QJsonObject{{"file", it.value().file}, {"paths", QJsonArray::fromStringList(it.value().paths)},
+                                               {"hash", QString::fromLatin1(it.value().digest.toBase64())}};
+        map["components"] = components;
+    }
+    return QJsonDocument(map).toJson();
+}
+
+bool Manifest::applyDiff(const QJsonObject& diff, QSet<QString>& diffedFiles, QSet<QString>* removedFiles)
+{
+    if(diff.value("from").toString() != _version)
+        return false;
+
+    QSet<QString> removed;
+    for(Kind category : {Data, Exe})
+        for(QJsonValue file : diff.value("removed").toObject().value(categoryName(category) + "Files").toArray())
+            removed.insert(file.toString());
+    if(removedFiles)
+        *removedFiles += removed;
+    remove(removed);
+
+    QSet<QString> changed;
+    for(QString change : {"added", "changed"})
+    {
+        if(!readCategory(*this, diff.value(change).toObject(), Data, &changed)
+        || !readCategory(*this, diff.value(change).toObject(), Exe, &changed))
+            return false; // the caller falls back to the full version json
+    }
+    diffedFiles += changed;
+
+    // the patches of an older version of a file would rebuild that older version
+    for(const QString& file : removed + changed)
+        _patches.remove(file);
+    readPatches(*this, diff.value("patches").toObject());
+    _components.clear(); // diffs always carry the components of their version
+    readComponents(*this, diff.value("components").toObject());
+    _version = diff.value("to").toString();
+    return true;
+}
+
+void Manifest::clear()
+{
+    _version.clear();
+    _entries.clear();
+    _pathArena.clear();
+    _digestSlots.clear();
+    _buckets.clear();
+    _patches.clear();
+    _components.clear();
+}
+
+void Manifest::reserve(int count)
+{
+    _entries.reserve(count);
+    _digestSlots.reserve(count * DigestSize);
+    int capacity = 16;
+    while(capacity < count * 2)
+        capacity *= 2;
+    if(capacity > int(_buckets.size()))
+        rehash(capacity);
+}
+
+void Manifest::remove(const QSet<QString>& paths)
+{
+    if(paths.isEmpty())
+        return;
+
+    // removing files requires rebuilding the arena and the index
+    Manifest kept;
+    kept.reserve(count());
+    kept._version = _version;
+    kept._patches = _patches;
+    kept._components = _components;
+    for(int i=0; i<count(); ++i)
+    {
+        QString file = path(i);
+        if(!paths.contains(file))
+            kept.insert(file, kind(i), digest(i), fileSize(i));
+        else
+            kept._patches.remove(file);
+    }
+    *this = std::move(kept);
+}
+
+int Manifest::insert(const QString& path, Kind kind, const QByteArray& digest, qint64 size)
+{
+    QByteArray utf8 = path.toUtf8();
+    if(utf8.size() > std::numeric_limits<quint16>::max())
+        return -1; // see Entry::pathLength
+    if((count() + 1) * 2 > int(_buckets.size()))
+        rehash(qMax(16, int(_buckets.size()) * 2));
+
+    int bucket = find(utf8.constData(), utf8.size(), qHashBits(utf8.constData(), utf8.size()));
+    int i = _buckets[bucket];
+    if(i < 0)
+    {
+        i = count();
+        _buckets[bucket] = i;
+        _entries.push_back({size, quint32(_pathArena.size()), quint16(utf8.size()), quint8(kind)});
+        _pathArena.append(utf8);
+        _digestSlots.resize(_digestSlots.size() + DigestSize);
+    }
+    else
+    {
+        _entries[i].size = size;
+        _entries[i].kind = kind;
+    }
+
+    char* slot = _digestSlots.data() + i * DigestSize;
+    std::memset(slot, 0, DigestSize);
+    std::memcpy(slot, digest.constData(), size_t(qMin(digest.size(), int(DigestSize))));
+    return i;
+}
+
+int Manifest::indexOf(const QString& path) const
+{
+    if(_buckets.empty())
+        return -1;
+    QByteArray utf8 = path.toUtf8();
+    return _buckets[find(utf8.constData(), utf8.size(), qHashBits(utf8.constData(), utf8.size()))];
+}
+
+QString Manifest::path(int i) const
+{
+    return QString::fromUtf8(_pathArena.constData() + _entries[i].pathOffset, _entries[i].pathLength);
+}
+
+QByteArray Manifest::digest(int i) const
+{
+    return QByteArray(_digestSlots.constData() + i * DigestSize, DigestSize);
+}
+
+bool Manifest::digestEquals(int i, const QByteArray& digest) const
+{
+    return digest.size() == DigestSize && std::memcmp(_digestSlots.constData() + i * DigestSize, digest.constData(), DigestSize) == 0;
+}
+
+bool Manifest::checkFile(int i, const QString& fileName) const
+{
+    QFile f(fileName);
+    if(!f.open(QFile::ReadOnly) || f.size() != fileSize(i))
+        return false;
+    QCryptographicHash hashFunc(QCryptographicHash::Sha1);
+    hashFunc.addData(&f);
+    return digestEquals(i, hashFunc.result());
+}
+
+void Manifest::setPatches(const QString& path, const QList<Patch>& patches)
+{
+    if(patches.isEmpty())
+        _patches.remove(path);
+    else
+        _patches[path] = patches;
+}
+
+std::vector<int> Manifest::sortedIndexes() const
+{
+    std::vector<int> indexes(_entries.size());
+    for(int i=0; i<count(); ++i)
+        indexes[size_t(i)] = i;
+    std::sort(indexes.begin(), indexes.end(), [this](int a, int b){
+        int length = qMin(_entries[a].pathLength, _entries[b].pathLength);
+        int cmp = std::memcmp(_pathArena.constData() + _entries[a].pathOffset, _pathArena.constData() + _entries[b].pathOffset, size_t(length));
+        return cmp < 0 || (cmp == 0 && _entries[a].pathLength < _entries[b].pathLength);
+    });
+    return indexes;
+}
+
+int Manifest::comparePath(int i, const QByteArray& path) const
+{
+    int length = qMin(int(_entries[i].pathLength), path.size());
+    int cmp = std::memcmp(_pathArena.constData() + _entries[i].pathOffset, path.constData(), size_t(length));
+    return cmp != 0 ? cmp : int(_entries[i].pathLength) - path.size();
+}
+
+int Manifest::find(const char* path, int length, uint hash) const
+{
+    // linear probing, the table is never more than half full
+    size_t mask = _buckets.size() - 1;
+    for(size_t bucket = hash & mask; ; bucket = (bucket + 1) & mask)
+    {
+        qint32 i = _buckets[bucket];
+        if(i < 0 || (_entries[i].pathLength == length
+                     && std::memcmp(_pathArena.constData() + _entries[i].pathOffset, path, size_t(length)) == 0))
+            return int(bucket);
+    }
+}
+
+void Manifest::rehash(int capacity)
+{
+    _buckets.assign(size_t(capacity), -1);
+    for(int i=0; i<count(); ++i)
+    {
+        const char* path = _pathArena.constData() + _entries[i].pathOffset;
+        int length = _entries[i].pathLength;
+        _buckets[find(path, length, qHashBits(path, size_t(length)))] = i;
+    }
+}
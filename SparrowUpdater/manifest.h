@@ -0,0 +1,111 @@
+#ifndef MANIFEST_H
+#define MANIFEST_H
+
+#include <QString>
+#include <QByteArray>
+#include <QSet>
+#include <QHash>
+#include <QList>
+#include <QMap>
+#include <QStringList>
+#include <vector>
+
+class QJsonObject;
+
+/**
+ * @brief The Manifest class is the compact in-memory form of a version json
+ *
+ * paths are interned once in a single utf8 arena, digests are stored in fixed size slots,
+ * sizes are 64 bits and entries are found by path through an open addressing hash index.
+ * files are designated by their index, which stays valid until the manifest is modified
+ */
+class Manifest
+{
+public:
+    enum Kind : quint8 { Data, Exe };
+    static const int DigestSize = 20; // sha1
+
+    /// binary patch (see BinaryPatch) rebuilding a file from an older version of it
+    struct Patch
+    {
+        QByteArray source; // digest of the older version
+        QString    file;   // path of the patch on the server
+        qint64     size;
+    };
+
+    /// optional part of the app, its files are listed in a sub-manifest fetched on demand
+    struct Component
+    {
+        QString     file;   // path of the sub-manifest on the server
+        QStringList paths;  // QRegExp of the paths of its files
+        QByteArray  digest; // of the sub-manifest
+    };
+
+    /// parses a version json (see VersionUpdater::generateVersionJson), returns false on error (including a path too long to be stored)
+    bool fromJson(const QByteArray& versionJson, QString* error = nullptr);
+    /// serializes the manifest back to the version json format
+    QByteArray toJson() const;
+
+    /**
+     * applies a version diff (see VersionUpdater::generateVersionDiff)
+     * paths added or changed by the diff are inserted into diffedFiles, removed paths into removedFiles
+     * returns false if the diff doesn't start from this version, or has a path too long to be stored (the manifest is then left partially diffed)
+     */
+    bool applyDiff(const QJsonObject& diff, QSet<QString>& diffedFiles, QSet<QString>* removedFiles = nullptr);
+
+    void clear();
+    void reserve(int count);
+    /// removes files, this rebuilds the whole manifest
+    void remove(const QSet<QString>& paths);
+
+    /// adds a file, or replaces the file with the same path, returns its index, or -1 if the utf8 path is longer than 65535 bytes
+    int insert(const QString& path, Kind kind, const QByteArray& digest, qint64 size);
+    /// returns the index of the file, or -1 if it is not in the manifest
+    int indexOf(const QString& path) const;
+
+    int count() const { return int(_entries.size()); }
+    QString path(int i) const;
+    Kind kind(int i) const { return Kind(_entries[i].kind); }
+    qint64 fileSize(int i) const { return _entries[i].size; }
+    QByteArray digest(int i) const;
+    bool digestEquals(int i, const QByteArray& digest) const;
+    /// hashes the file at fileName, returns true if it has the size and the digest of file i
+    bool checkFile(int i, const QString& fileName) const;
+
+    /// binary patches to the file, from older versions of it
+    QList<Patch> patches(const QString& path) const { return _patches.value(path); }
+    void setPatches(const QString& path, const QList<Patch>& patches);
+
+    /// components of the app, by name
+    const QMap<QString, Component>& components() const { return _components; }
+    void setComponent(const QString& name, const Component& component) { _components[name] = component; }
+
+    /// indexes of all files sorted by utf8 path, and the matching comparison of a file path with an utf8 path
+    std::vector<int> sortedIndexes() const;
+    int comparePath(int i, const QByteArray& path) const;
+
+    QString version() const { return _version; }
+    void setVersion(const QString& version) { _version = version; }
+
+private:
+    struct Entry
+    {
+        qint64  size;
+        quint32 pathOffset;
+        quint16 pathLength;
+        quint8  kind;
+    };
+
+    int find(const char* path, int length, uint hash) const;
+    void rehash(int capacity);
+
+    QString             _version;
+    std::vector<Entry>  _entries;
+    QByteArray          _pathArena;   // utf8 paths, one after the other
+    QByteArray          _digestSlots; // DigestSize bytes per entry
+    std::vector<qint32> _buckets;     // entry indexes, -1 when empty, power of 2 size
+    QHash<QString, QList<Patch>> _patches; // few files have patches, they are kept by path
+    QMap<QString, Component>     _components;
+};
+
+#endif // MANIFEST_H
@@ -0,0 +1,250 @@
+#include "rollbackstore.h"
+
+#include "manifest.h"
+
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QSaveFile>
+#include <QJsonDocument>
+#include <QJsonArray>
+
+#ifdef Q_OS_WIN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+// =============== UTILITY ===============
+
+// hard link where the filesystem allows it, both paths then share the content until one of them is replaced
+static bool linkFile(const QString& source, const QString& target)
+{
+#ifdef Q_OS_WIN
+    return CreateHardLinkW(reinterpret_cast<const wchar_t*>(QDir::toNativeSeparators(target).utf16()),
+                           reinterpret_cast<const wchar_t*>(QDir::toNativeSeparators(source).utf16()), nullptr);
+#else
+    return ::link(QFile::encodeName(source).constData(), QFile::encodeName(target).constData()) == 0;
+#endif
+}
+
+// =============== RollbackStore class ===============
+
+RollbackStore::RollbackStore(QObject* parent, const QString& rootDir, const QString& storeDir, const QString& installedVersionFile)
+:   QObject(parent)
+,   _rootDir(rootDir + '/')
+,   _storeDir(storeDir + '/')
+,   _installedVersionFile(installedVersionFile)
+,   _maxVersions(0)
+{
+}
+
+QStringList RollbackStore::versions() const
+{
+    QFile index(_rootDir + _storeDir + "index.json");
+    if(!index.open(QFile::ReadOnly))
+        return QStringList();
+    return QJsonDocument::fromJson(index.readAll()).toVariant().toStringList();
+}
+
+bool RollbackStore::readManifest(const QString& version, Manifest& manifest) const
+{
+    QFile manifestFile(_rootDir + _storeDir + version + ".json");
+    return versions().contains(version) && manifestFile.open(QFile::ReadOnly) && manifest.fromJson(manifestFile.readAll());
+}
+
+bool RollbackStore::writeIndex(const QStringList& versions)
+{
+    QSaveFile index(_rootDir + _storeDir + "index.json");
+    return index.open(QFile::WriteOnly) && index.write(QJsonDocument(QJsonArray::fromStringList(versions)).toJson()) >= 0 && index.commit();
+}
+
+bool RollbackStore::keep(const QStringList& movedFiles, const QStringList& linkedFiles, QString movedDir)
+{
+    if(_maxVersions <= 0)
+        return true;
+
+    // the files are kept under the installed version, unknown without an installed version json
+    if(movedDir.isEmpty())
+        movedDir = _rootDir;
+    Manifest installed;
+    QFile installedFile(_rootDir + _installedVersionFile);
+    if(!installedFile.open(QFile::ReadOnly) || !installed.fromJson(installedFile.readAll()))
+    {
+        emit unavailable(tr("No installed version to keep, %1 is missing or invalid").arg(_installedVersionFile));
+        return false;
+    }
+    QString version = installed.version();
+    QString folder = _rootDir + _storeDir + version + '/';
+    QStringList versions = this->versions();
+    if(!versions.contains(version))
+    {
+        QDir(folder).removeRecursively(); // left by an interrupted apply
+        QFile::remove(_rootDir + _storeDir + version + ".json");
+        if(!QDir().mkpath(folder) || !QFile::copy(_rootDir + _installedVersionFile, _rootDir + _storeDir + version + ".json"))
+        {
+            emit unavailable(tr("Can't create the rollback folder : %1").arg(folder));
+            return false;
+        }
+    }
+    versions.removeAll(version);
+    versions.prepend(version);
+    if(!writeIndex(versions))
+    {
+        emit unavailable(tr("Can't write the rollback index : %1").arg(_rootDir + _storeDir + "index.json"));
+        return false;
+    }
+
+    // the first copy of a file is the one of the version, a later apply from the same version doesn't replace it
+    for(QString file : movedFiles)
+    {
+        QString target = folder + file;
+        if(!QFileInfo::exists(movedDir + file))
+            continue;
+        if(!QFileInfo::exists(target) && QDir().mkpath(QFileInfo(target).path()) && QFile::rename(movedDir + file, target))
+            continue;
+        if(QFileInfo::exists(target) || QFile::copy(movedDir + file, target))
+            QFile::remove(movedDir + file); // replaced by a new file, never written in place
+    }
+    for(QString file : linkedFiles)
+    {
+        QString target = folder + file;
+        if(QFileInfo::exists(_rootDir + file) && !QFileInfo::exists(target) && QDir().mkpath(QFileInfo(target).path()))
+            if(!linkFile(_rootDir + file, target))
+                QFile::copy(_rootDir + file, target);
+    }
+    return true;
+}
+
+void RollbackStore::prune()
+{
+    QStringList versions = this->versions();
+    if(versions.size() <= _maxVersions)
+        return;
+    if(_maxVersions <= 0)
+    {
+        QDir(_rootDir + _storeDir).removeRecursively();
+        return;
+    }
+    while(versions.size() > _maxVersions)
+    {
+        QString version = versions.takeLast();
+        QDir(_rootDir + _storeDir + version).removeRecursively();
+        QFile::remove(_rootDir + _storeDir + version + ".json");
+    }
+    writeIndex(versions);
+}
+
+void RollbackStore::remove(const QString& version)
+{
+    QDir(_rootDir + _storeDir + version).removeRecursively();
+    QFile::remove(_rootDir + _storeDir + version + ".json");
+    QStringList versions = this->versions();
+    versions.removeAll(version);
+    writeIndex(versions);
+}
+
+QMap<QString, QString> RollbackStore::resolveSources(const Manifest& manifest, const Manifest& installed, const QVariantMap& record,
+                                                     const QStringList& candidates, QStringList& errors, const std::atomic<bool>* canceled) const
+{
+    // every file is resolved before anything is touched : the version's own copy first, then the other kept versions, then the local file
+    QMap<QString, QString> sources; // path -> absolute path of the kept copy to restore
+    for(int i=0; i<manifest.count() && !*canceled; ++i)
+    {
+        QString path = manifest.path(i);
+        int j = installed.indexOf(path);
+        QVariantList stat = record.value(path).toList();
+        QFileInfo info(_rootDir + path);
+        if(j >= 0 && installed.fileSize(j) == manifest.fileSize(i) && installed.digestEquals(j, manifest.digest(i))
+        && stat.size() == 2 && stat[0].toLongLong() == info.size() && stat[1].toLongLong() == info.lastModified().toMSecsSinceEpoch())
+            continue;
+
+        QString source;
+        for(QString kept : candidates)
+        {
+            if(manifest.checkFile(i, _rootDir + _storeDir + kept + '/' + path))
+            {
+                source = _rootDir + _storeDir + kept + '/' + path;
+                break;
+            }
+        }
+        if(!source.isEmpty())
+            sources[path] = source;
+        else if(!manifest.checkFile(i, _rootDir + path))
+            errors << tr("Can't restore file : %1").arg(_rootDir + path);
+    }
+    return sources;
+}
+
+bool RollbackStore::restore(const QString& version, const Manifest& manifest, const Manifest& installed, const QMap<QString, QString>& sources,
+                            const QString& exeDir, QStringList& restoredExe, QStringList& errors)
+{
+    QString folder = _rootDir + _storeDir + version + '/';
+    QString restoreDir = _rootDir + _storeDir + version + ".restore/";   // restored data files, before the swap
+    QString replacedDir = _rootDir + _storeDir + version + ".replaced/"; // data files of the current version, after the swap
+    QDir(restoreDir).removeRecursively(); // left by an interrupted rollback
+    QDir(replacedDir).removeRecursively();
+    QDir(_rootDir + exeDir).removeRecursively();
+
+    QStringList replacedData;
+    restoredExe.clear();
+    for(auto it = sources.cbegin(); it != sources.cend(); ++it)
+    {
+        if(manifest.kind(manifest.indexOf(it.key())) == Manifest::Exe)
+            restoredExe << it.key();
+        else
+            replacedData << it.key();
+    }
+    QStringList restoredData = replacedData;
+    for(int j=0; j<installed.count(); ++j)
+        if(manifest.indexOf(installed.path(j)) < 0)
+            replacedData << installed.path(j); // not part of the restored version, removed
+
+    // the restored files are gathered first, the files of the root folder are untouched until they all are.
+    // the copies of the version itself are linked, they go away with it. the copies of other kept versions are copied,
+    // a later write in place of a data file must not change them. exe files are left to the update script, which copies them
+    for(auto it = sources.cbegin(); it != sources.cend() && errors.isEmpty(); ++it)
+    {
+        bool exe = restoredExe.contains(it.key());
+        QString target = (exe ? _rootDir + exeDir + '/' : restoreDir) + it.key();
+        bool linkable = exe || it.value().startsWith(folder);
+        if(!QDir().mkpath(QFileInfo(target).path()) || !((linkable && linkFile(it.value(), target)) || QFile::copy(it.value(), target)))
+            errors << tr("Can't restore file : %1").arg(_rootDir + it.key());
+    }
+
+    // then swapped in, a rename per file, every rename is undone if one fails
+    QStringList swapped;
+    for(int k=0; k<replacedData.size() && errors.isEmpty(); ++k)
+    {
+        QString path = replacedData[k];
+        bool ok = !QFileInfo::exists(_rootDir + path)
+               || (QDir().mkpath(QFileInfo(replacedDir + path).path()) && QFile::rename(_rootDir + path, replacedDir + path));
+        if(ok && restoredData.contains(path))
+            ok = QDir().mkpath(QFileInfo(_rootDir + path).path()) && QFile::rename(restoreDir + path, _rootDir + path);
+        swapped << path; // even half way, the undo checks what was moved
+        if(!ok)
+            errors << tr("Can't restore file : %1").arg(_rootDir + path);
+    }
+    if(!errors.isEmpty())
+    {
+        for(QString path : swapped)
+        {
+            if(restoredData.contains(path) && !QFileInfo::exists(restoreDir + path))
+                QFile::remove(_rootDir + path);
+            if(QFileInfo::exists(replacedDir + path))
+                QFile::rename(replacedDir + path, _rootDir + path);
+        }
+        QDir(restoreDir).removeRecursively();
+        QDir(replacedDir).removeRecursively();
+        QDir(_rootDir + exeDir).removeRecursively();
+        return false;
+    }
+
+    // the current version is kept in turn, unless the installed version json isn't up to date with the files yet
+    if(installed.version() != version)
+        keep(replacedData, restoredExe, replacedDir);
+    QDir(restoreDir).removeRecursively();
+    QDir(replacedDir).removeRecursively();
+    return true;
+}
@@ -0,0 +1,76 @@
+#ifndef ROLLBACKSTORE_H
+#define ROLLBACKSTORE_H
+
+#include <QObject>
+#include <QStringList>
+#include <QVariantMap>
+#include <QMap>
+#include <atomic>
+
+class Manifest;
+
+/**
+ * @brief The RollbackStore class keeps the files replaced or removed by the updates of the last installed versions
+ *
+ * each kept version has its version json and a folder with its files that the updates replaced or removed since.
+ * data files are moved there, exe and stale files are hard linked where the filesystem allows it (copied otherwise),
+ * so a kept version costs little more disk space than the files that changed. an index lists the kept versions, newest first
+ */
+class RollbackStore : public QObject
+{
+    Q_OBJECT
+public:
+    /// storeDir and installedVersionFile are relative to rootDir
+    RollbackStore(QObject* parent, const QString& rootDir, const QString& storeDir, const QString& installedVersionFile);
+
+    /// number of installed versions kept, 0 disables the store : the kept versions are removed by the next prune()
+    void setMaxVersions(int versions) { _maxVersions = versions; }
+    int maxVersions() const { return _maxVersions; }
+
+    /// kept versions, newest first
+    QStringList versions() const;
+    /// reads the version json of a kept version, returns false if the version isn't kept
+    bool readManifest(const QString& version, Manifest& manifest) const;
+
+    /**
+     * keeps the files of the installed version that are about to be replaced or removed : movedFiles are moved from movedDir
+     * (rootDir by default), linkedFiles are linked from rootDir. the first copy of a file is the one of the version.
+     * returns false, after emitting "unavailable", if they can't be kept
+     */
+    bool keep(const QStringList& movedFiles, const QStringList& linkedFiles, QString movedDir = QString());
+    /// removes the oldest versions over the maximum
+    void prune();
+    /// removes a kept version
+    void remove(const QString& version);
+
+    /**
+     * resolves the kept copy to restore of every file of a kept version that doesn't match the file of rootDir :
+     * the copy of the version itself first, then the copies of the other candidates. the files of the installed version
+     * with the stat record of its last check are trusted. the files that can't be restored are listed in errors.
+     * it only reads files, so it is run by a thread
+     */
+    QMap<QString, QString> resolveSources(const Manifest& manifest, const Manifest& installed, const QVariantMap& record,
+                                          const QStringList& candidates, QStringList& errors, const std::atomic<bool>* canceled) const;
+
+    /**
+     * restores the files resolved by "resolveSources" : the data files are gathered in a temporary folder, then swapped with
+     * the files of rootDir, every swap is undone if one fails. the exe files are gathered in exeDir, listed in restoredExe.
+     * the installed version is then kept in turn
+     */
+    bool restore(const QString& version, const Manifest& manifest, const Manifest& installed, const QMap<QString, QString>& sources,
+                 const QString& exeDir, QStringList& restoredExe, QStringList& errors);
+
+signals:
+    /// emitted by "keep" when the installed files can't be kept, the update goes on without them
+    void unavailable(QString reason);
+
+private:
+    bool writeIndex(const QStringList& versions);
+
+    QString _rootDir;
+    QString _storeDir;
+    QString _installedVersionFile;
+    int     _maxVersions;
+};
+
+#endif // ROLLBACKSTORE_H
@@ -1,106 +1,482 @@
 #include "updaterclient.h"
 
-#include <QNetworkAccessManager>
-#include <QNetworkReply>
-#include <QAuthenticator>
+#include "updatertransport.h"
+#include "localtransport.h"
+
 #include <QFile>
 #include <QDir>
 #include <QCoreApplication>
+#include <QCryptographicHash>
+#include <QRandomGenerator>
+#include <QTimer>
+#include <QUrl>
+#include <memory>
 
 static const QString VERSION_FILE = "version.json";
 
+// transport of an unsupported base url, every request fails with the same error
+class UnsupportedTransport : public UpdaterTransport
+{
+public:
+    UnsupportedTransport(QObject* parent, const QString& error) : UpdaterTransport(parent), _error(error) {}
+    
+    TransportReply* get(const QString&, const QString&, const CacheValidators&) override
+    {
+        TransportReply* reply = new TransportReply(this);
+        QTimer::singleShot(0, reply, [this, reply](){ reply->finish(TransportReply::PermanentError, _error); }); // once connected
+        return reply;
+    }
+    
+private:
+    QString _error;
+};
+
 UpdaterClient::UpdaterClient(QObject* parent, const QString &baseUrl)
 :	QObject(parent)
+,   _transport(nullptr)
 ,   nbFilesPending(0)
-,   _baseUrl(baseUrl)
+,   nbBatchFiles(0)
+,   _batchOpen(false)
 ,   _hasFailed(false)
+,   _maxAttempts(4)
+,   _baseRetryDelay(500)
+,   _maxRetryDelay(30000)
+,   _generation(0)
+,   _inFlight(0)
+,   _concurrencyLimit(4)
+,   _minConcurrency(1)
+,   _maxConcurrency(16)
+,   _concurrencyTimer(new QTimer(this))
+,   _windowBytes(0)
+,   _windowLatency(0)
+,   _windowLatencySamples(0)
+,   _windowErrors(0)
+,   _windowSaturated(false)
+,   _throughput(0)
+,   _latency(0)
+,   _baseLatency(-1)
+,   _throughputBeforeIncrease(-1)
+,   _throughputSinceIncrease(0)
+,   _windowsSinceIncrease(0)
+,   _holdWindows(0)
 {
-	manager = new QNetworkAccessManager(this);
-    connect(manager, &QNetworkAccessManager::authenticationRequired            , this, [this](){_hasFailed = true; _errors << "QNetworkAccessManager::authenticationRequired";});
-    connect(manager, &QNetworkAccessManager::preSharedKeyAuthenticationRequired, this, [this](){_hasFailed = true; _errors << "QNetworkAccessManager::preSharedKeyAuthenticationRequired";});
-    connect(manager, &QNetworkAccessManager::proxyAuthenticationRequired       , this, [this](){_hasFailed = true; _errors << "QNetworkAccessManager::proxyAuthenticationRequired";});
-    connect(manager, &QNetworkAccessManager::networkAccessibleChanged          , this, [this](){_hasFailed = true; _errors << "QNetworkAccessManager::networkAccessibleChanged";});
-    connect(manager, &QNetworkAccessManager::sslErrors                         , this, [this](){_hasFailed = true; _errors << "QNetworkAccessManager::sslErrors";});
-    connect(manager, &QNetworkAccessManager::encrypted                         , this, [this](){_hasFailed = true; _errors << "QNetworkAccessManager::encrypted";});
+    _concurrencyTimer->setInterval(1000);
+    connect(_concurrencyTimer, &QTimer::timeout, this, &UpdaterClient::adjustConcurrency);
+    
+
+    // local folders skip the web server
+    QUrl url(baseUrl);
+    QString scheme = url.scheme().toLower();
+    if(url.isLocalFile())
+        setTransport(new LocalTransport(this, url.toLocalFile()));
+    else if(QDir::isAbsolutePath(baseUrl)) // including windows drive letters and network shares
+        setTransport(new LocalTransport(this, QDir::fromNativeSeparators(baseUrl)));
+    else if(scheme == "http" || scheme == "https")
+        setTransport(new HttpTransport(this, baseUrl));
+    else
+        setTransport(new UnsupportedTransport(this, QString("Unsupported update url : %1").arg(baseUrl)));
 }
 
-void UpdaterClient::getLastVersion()
+void UpdaterClient::setTransport(UpdaterTransport* transport)
 {
-    QNetworkRequest request(QUrl(_baseUrl + VERSION_FILE));
-    QNetworkReply* reply = manager->get(request);
-    connect(reply, &QNetworkReply::finished, this, [=](){ handleVersion(reply); });
+    if(_transport)
+        _transport->deleteLater();
+    _transport = transport;
+    _transport->setParent(this);
+    connect(_transport, &UpdaterTransport::transportError, this, [this](QString error){ _hasFailed = true; _errors << error; });
 }
 
-void UpdaterClient::getFile(QString filename, QString dstDir)
+void UpdaterClient::getLastVersion(const CacheValidators& validators)
 {
-    _progress[filename] = {0,0};
+    _errors.clear(); // the errors of the previous requests are already reported
+    TransportReply* reply = _transport->get(VERSION_FILE, QString(), validators);
+    connect(reply, &TransportReply::finished, this, [=](){ handleVersion(reply); });
+}
+
+void UpdaterClient::getManifestFile(QString filename, const CacheValidators& validators)
+{
+    TransportReply* reply = _transport->get(filename, QString(), validators);
+    connect(reply, &TransportReply::finished, this, [=](){ handleManifestFile(reply, filename); });
+}
+
+void UpdaterClient::getFile(QString filename, QString dstDir, QByteArray expectedHash, qint64 expectedSize)
+{
+    if(nbFilesPending == 0 && !_batchOpen)
+    {
+        _hasFailed = false;
+        _errors.clear();
+        _failedFiles.clear();
+    }
+    _progress[filename] = {0, expectedSize};
+    _expectedSizes[filename] = expectedSize;
+    ++nbFilesPending;
+    ++nbBatchFiles;
+    requestFile(filename, dstDir, expectedHash, 1);
+}
+
+void UpdaterClient::getOptionalFile(QString filename, QString dstDir, QByteArray expectedHash, qint64 expectedSize)
+{
+    getFile(filename, dstDir, expectedHash, expectedSize);
+    _optionalFiles.insert(dstDir + '/' + filename);
+}
+
+void UpdaterClient::requestFile(QString filename, QString dstDir, QByteArray expectedHash, int attempt)
+{
+    if(_inFlight >= _concurrencyLimit)
+    {
+        _queuedFiles.push_back({filename, dstDir, expectedHash, attempt});
+        _windowSaturated = true;
+        return;
+    }
+    ++_inFlight;
+    if(!_concurrencyTimer->isActive())
+    {
+        _windowTimer.start();
+        _concurrencyTimer->start();
+    }
     
-    QNetworkRequest request(QUrl(_baseUrl + filename));
-    QNetworkReply* reply = manager->get(request);
-    connect(reply, &QNetworkReply::downloadProgress, this, [=](qint64 bytesReceived, qint64 bytesTotal){
-        _progress[filename] = {bytesReceived, bytesTotal};
+    // the latency is the time to the first byte, the whole transfer time depends on the file size
+    QElapsedTimer started;
+    started.start();
+    auto firstByte = std::make_shared<bool>(false);
+    const auto sampleLatency = [=](){
+        if(*firstByte)
+            return;
+        *firstByte = true;
+        _windowLatency += started.elapsed();
+        ++_windowLatencySamples;
+    };
+    
+    // a transport may have queued the result of a reply before it was aborted, the replies of older generations are dropped
+    int generation = _generation;
+    TransportReply* reply = _transport->get(filename, qApp->applicationDirPath() + '/' + dstDir + '/' + filename);
+    connect(reply, &TransportReply::progress, this, [=](qint64 bytesReceived, qint64 bytesTotal){
+        if(generation != _generation)
+            return;
+        if(bytesReceived > 0)
+            sampleLatency();
+        countReceived(filename, bytesReceived);
+        _progress[filename] = {bytesReceived, bytesTotal > 0 ? bytesTotal : _expectedSizes.value(filename)};
         emit progressChanged();
     });
-    connect(reply, &QNetworkReply::finished, this, [=](){ handleFile(reply, filename, dstDir); });
-    connect(this, &UpdaterClient::failed, reply, &QNetworkReply::abort);
-    ++nbFilesPending;
+    connect(reply, &TransportReply::finished, this, [=](){
+        if(generation != _generation)
+        {
+            reply->deleteLater();
+            --_inFlight;
+            startQueuedFiles();
+            return;
+        }
+        if(reply->error() == TransportReply::NoError)
+        {
+            sampleLatency();
+            countReceived(filename, reply->data().size());
+        }
+        handleFile(reply, filename, dstDir, expectedHash, attempt);
+    });
+    connect(this, &UpdaterClient::aborted, reply, &TransportReply::abort);
+}
+
+void UpdaterClient::startQueuedFiles()
+{
+    while(_inFlight < _concurrencyLimit && !_queuedFiles.isEmpty())
+    {
+        QueuedFile file = _queuedFiles.takeFirst();
+        requestFile(file.filename, file.dstDir, file.expectedHash, file.attempt);
+    }
+}
+
+void UpdaterClient::countReceived(const QString& filename, qint64 bytesReceived)
+{
+    auto it = _progress.find(filename);
+    if(it != _progress.end() && bytesReceived > it->second.first)
+        _windowBytes += bytesReceived - it->second.first;
 }
 
-void UpdaterClient::handleVersion(QNetworkReply* reply)
+void UpdaterClient::setConcurrency(int initialLimit, int minLimit, int maxLimit)
+{
+    _minConcurrency = qMax(1, minLimit);
+    _maxConcurrency = qMax(_minConcurrency, maxLimit);
+    _concurrencyLimit = qBound(_minConcurrency, initialLimit, _maxConcurrency);
+    _throughputBeforeIncrease = -1;
+    _holdWindows = 0;
+    startQueuedFiles();
+}
+
+void UpdaterClient::adjustConcurrency()
+{
+    if(_inFlight == 0 && _queuedFiles.isEmpty())
+    {
+        _concurrencyTimer->stop(); // idle, the next download starts a new window
+        _baseLatency = -1;         // and may go elsewhere (mirror, proxy...)
+        _windowBytes = 0;
+        _windowLatency = 0;
+        _windowLatencySamples = 0;
+        _windowErrors = 0;
+        _windowSaturated = false;
+        _throughputBeforeIncrease = -1;
+        return;
+    }
+    
+    // measures of the window
+    qint64 elapsed = qMax<qint64>(1, _windowTimer.restart());
+    qint64 throughput = _windowBytes * 1000 / elapsed;
+    _throughput = _throughput == 0 ? throughput : (_throughput + throughput) / 2;
+    if(_windowLatencySamples > 0)
+    {
+        _latency = int(_windowLatency / _windowLatencySamples);
+        _baseLatency = _baseLatency < 0 ? _latency : qMin(_baseLatency, _latency);
+    }
+    
+    // an increase is judged on the raw throughput of the windows since, the first one is still ramping up the new downloads
+    bool measuring = _throughputBeforeIncrease >= 0;
+    if(measuring)
+    {
+        _throughputSinceIncrease += throughput;
+        ++_windowsSinceIncrease;
+    }
+    
+    // additive increase while it pays off, multiplicative decrease on congestion
+    int limit = _concurrencyLimit;
+    QString reason;
+    if(_windowErrors > 0)
+    {
+        limit /= 2;
+        reason = "errors";
+    }
+    else if(_windowLatencySamples > 0 && _latency > 2 * _baseLatency + 20)
+    {
+        limit = limit * 3 / 4;
+        reason = "latency";
+    }
+    else if(measuring && _windowsSinceIncrease < 2)
+    {
+        // measured over one more window
+    }
+    else if(_windowSaturated && measuring && _throughputSinceIncrease / _windowsSinceIncrease < _throughputBeforeIncrease * 105 / 100)
+    {
+        limit -= 1;
+        reason = "plateau";
+        _holdWindows = 10;
+    }
+    else if(_windowSaturated && _holdWindows > 0)
+        --_holdWindows;
+    else if(_windowSaturated)
+    {
+        limit += 1;
+        reason = "increase";
+    }
+    limit = qBound(_minConcurrency, limit, _maxConcurrency);
+    if(limit != _concurrencyLimit || _windowsSinceIncrease >= 2)
+        _throughputBeforeIncrease = -1; // judged, or overridden
+    if(limit > _concurrencyLimit)
+        _throughputBeforeIncrease = _throughput;
+    if(_throughputBeforeIncrease < 0 || limit > _concurrencyLimit)
+    {
+        _throughputSinceIncrease = 0;
+        _windowsSinceIncrease = 0;
+    }
+    
+    _windowBytes = 0;
+    _windowLatency = 0;
+    _windowLatencySamples = 0;
+    _windowErrors = 0;
+    _windowSaturated = !_queuedFiles.isEmpty();
+    if(limit != _concurrencyLimit)
+    {
+        _concurrencyLimit = limit;
+        emit concurrencyChanged(limit, _throughput, _latency, reason);
+        startQueuedFiles();
+    }
+}
+
+void UpdaterClient::setRetryPolicy(int maxAttempts, int baseDelayMs, int maxDelayMs)
+{
+    _maxAttempts = qMax(1, maxAttempts);
+    _baseRetryDelay = baseDelayMs;
+    _maxRetryDelay = maxDelayMs;
+}
+
+void UpdaterClient::getLazyFile(QString filename, QString dstDir)
+{
+    TransportReply* reply = _transport->get(filename);
+    connect(reply, &TransportReply::finished, this, [=](){ handleLazyFile(reply, filename, dstDir); });
+}
+
+void UpdaterClient::beginBatch()
+{
+    _batchOpen = true;
+    nbBatchFiles = 0;
+    _hasFailed = false;
+    _errors.clear();
+    _failedFiles.clear();
+}
+
+void UpdaterClient::endBatch()
+{
+    _batchOpen = false;
+    if(nbBatchFiles > 0 && nbFilesPending == 0)
+        finishFiles();
+}
+
+void UpdaterClient::abortDownloads()
+{
+    _batchOpen = false;
+    nbFilesPending = 0;
+    _progress.clear();
+    _expectedSizes.clear();
+    _queuedFiles.clear();
+    _optionalFiles.clear();
+    ++_generation; // cancels the pending retries
+    emit aborted(); // the replies finish with CanceledError, which handleFile ignores
+}
+
+void UpdaterClient::handleVersion(TransportReply* reply)
 {
     reply->deleteLater();
-    if(reply->error() != QNetworkReply::NetworkError::NoError)
+    if(reply->error() != TransportReply::NoError)
     {
         _hasFailed = true;
         _errors << reply->errorString();
         emit failed();
     }
+    else if(reply->notModified())
+    {
+        _hasFailed = false;
+        emit manifestFileUnchanged(VERSION_FILE);
+    }
     else
     {
         _hasFailed = false;
-        emit receivedLastVersion(reply->readAll());
+        _validators[VERSION_FILE] = reply->validators();
+        emit receivedLastVersion(reply->data());
     }
 }
 
-void UpdaterClient::handleFile(QNetworkReply* reply, QString filename, QString dstDir)
+void UpdaterClient::handleManifestFile(TransportReply* reply, QString filename)
+{
+    reply->deleteLater();
+    if(reply->error() != TransportReply::NoError)
+        emit manifestFileUnavailable(filename);
+    else if(reply->notModified())
+        emit manifestFileUnchanged(filename);
+    else
+    {
+        _validators[filename] = reply->validators();
+        emit receivedManifestFile(filename, reply->data());
+    }
+}
+
+void UpdaterClient::handleLazyFile(TransportReply* reply, QString filename, QString dstDir)
+{
+    reply->deleteLater();
+    if(reply->error() == TransportReply::NoError && writeFile(dstDir + "/" + filename, reply->data()))
+        emit lazyFileReceived(filename, dstDir);
+    else
+        emit lazyFileUnavailable(filename, dstDir);
+}
+
+void UpdaterClient::handleFile(TransportReply* reply, QString filename, QString dstDir, QByteArray expectedHash, int attempt)
 {
-    const auto customAssert = [this](bool condition, QString msg){
-        if(!condition)
-        {
-            _errors << msg;
-            _hasFailed = true;
-        }
-    };
-    
     reply->deleteLater();
-    if(!_hasFailed)
+    --_inFlight;
+    startQueuedFiles();
+    if(reply->error() == TransportReply::CanceledError)
+        return; // aborted
+    
+    // the transport may have written the file itself, it then only reports its hash
+    QString error;
+    bool transient = false;
+    bool written = !reply->writtenHash().isEmpty();
+    QByteArray data;
+    if(reply->error() != TransportReply::NoError)
     {
-        if(reply->error() != QNetworkReply::NetworkError::NoError)
+        error = reply->errorString();
+        transient = reply->error() == TransportReply::TransientError;
+        if(transient)
+            ++_windowErrors;
+    }
+    else
+    {
+        data = reply->data();
+        QByteArray hash = written ? reply->writtenHash() : QCryptographicHash::hash(data, QCryptographicHash::Sha1);
+        if(!expectedHash.isEmpty() && hash != expectedHash)
         {
-            _hasFailed = true;
-            _errors << reply->errorString();
-            emit failed();
+            error = QString("Hash mismatch for file : %1").arg(filename);
+            transient = true;
         }
+    }
+    if(!error.isEmpty() && written)
+        QFile::remove(qApp->applicationDirPath() + '/' + dstDir + '/' + filename);
+    
+    // transient errors are retried later, only this file is delayed
+    if(!error.isEmpty() && transient && attempt < _maxAttempts)
+    {
+        _progress[filename] = {0, _expectedSizes.value(filename)}; // still counted in the total while it waits
+        emit progressChanged();
+        int generation = _generation;
+        QTimer::singleShot(retryDelay(attempt), this, [=](){
+            if(generation == _generation) // not aborted in the meantime
+                requestFile(filename, dstDir, expectedHash, attempt + 1);
+        });
+        return;
+    }
+    
+    bool optional = _optionalFiles.remove(dstDir + '/' + filename);
+    _expectedSizes.remove(filename);
+    if(!error.isEmpty() && !optional)
+        _errors << QString("%1 (%2 attempts)").arg(error).arg(attempt);
+    if(!error.isEmpty() || (!written && !writeFile(dstDir + "/" + filename, data)))
+    {
+        _progress.erase(filename);
+        if(optional)
+            emit optionalFileUnavailable(filename, dstDir);
         else
         {
-            filename = dstDir + "/" + filename;
-            QFileInfo info(filename);
-            QString folder = info.dir().path();
-            customAssert(QDir(qApp->applicationDirPath()).mkpath(folder), QString("Can't create %1 dir").arg(folder));
-            QFile file(qApp->applicationDirPath() + '/' + filename);
-            customAssert(file.open(QFile::WriteOnly),QString("Can't open file for writing : %1").arg(filename));
-            QByteArray data = reply->readAll();
-            customAssert(file.write(data) == data.size(), QString("Failed to write %1 bytes in file : %2").arg(data.size()).arg(filename));
-            file.close();
-            // emit fileReceived(filename);
-            if(--nbFilesPending == 0)
-                emit allFilesReceived();
-            if(_hasFailed)
-                emit failed();
+            _hasFailed = true;
+            _failedFiles << filename;
         }
     }
+    else if(optional)
+        emit optionalFileReceived(filename, dstDir);
+    if(--nbFilesPending == 0 && !_batchOpen)
+        finishFiles();
+}
+
+void UpdaterClient::finishFiles()
+{
     if(_hasFailed)
-        _progress.erase(filename);
+        emit failed();
+    else
+        emit allFilesReceived();
+}
+
+int UpdaterClient::retryDelay(int attempt) const
+{
+    // exponential backoff, with jitter so that clients failing together don't retry together
+    qint64 delay = qMin<qint64>(_maxRetryDelay, qint64(_baseRetryDelay) << qMin(attempt - 1, 20));
+    int half = int(delay / 2);
+    return half + QRandomGenerator::global()->bounded(half + 1);
+}
+
+bool UpdaterClient::writeFile(const QString& filename, const QByteArray& data)
+{
+    bool ok = true;
+    const auto customAssert = [this, &ok](bool condition, QString msg){
+        if(!condition)
+        {
+            _errors << msg;
+            ok = false;
+        }
+    };
+    
+    QFileInfo info(filename);
+    QString folder = info.dir().path();
+    customAssert(QDir(qApp->applicationDirPath()).mkpath(folder), QString("Can't create %1 dir").arg(folder));
+    QFile file(qApp->applicationDirPath() + '/' + filename);
+    customAssert(file.open(QFile::WriteOnly),QString("Can't open file for writing : %1").arg(filename));
+    customAssert(file.write(data) == data.size(), QString("Failed to write %1 bytes in file : %2").arg(data.size()).arg(filename));
+    return ok;
 }
 
 std::pair<qint64,qint64> UpdaterClient::getTotalProgress()
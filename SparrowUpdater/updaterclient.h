@@ -2,11 +2,16 @@
 #define UPDATERCLIENT_H
 
 #include <QObject>
+#include <QHash>
+#include <QList>
+#include <QSet>
+#include <QElapsedTimer>
 #include <memory>
 
-class QNetworkAccessManager;
+#include "updatertransport.h"
+
 class Version;
-class QNetworkReply;
+class QTimer;
 
 #ifndef QSTRING_HASH
 #define QSTRING_HASH
@@ -28,16 +33,70 @@ class UpdaterClient : public QObject
 {
 	Q_OBJECT
 public:
+    /**
+     * baseUrl is an http or https URL, or a local folder (file:// URL or absolute path) read through a LocalTransport.
+     * with any other url, every request fails
+     */
 	explicit UpdaterClient(QObject* parent, const QString& baseUrl);
     virtual ~UpdaterClient() {}
     
-    /// request data from the server
-    void getLastVersion();
-    void getFile(QString filename, QString dstDir);
+    /// replaces the transport chosen from the base url, the client takes ownership of it
+    void setTransport(UpdaterTransport* transport);
+    
+    /**
+     * request data from the server, expectedHash is the sha1 of the file if known
+     * with validators, the version json (or the manifest file) is only downloaded if it changed since, see "manifestFileUnchanged"
+     * expectedSize counts the file in the total progress while it waits for a free download slot
+     */
+    void getLastVersion(const CacheValidators& validators = CacheValidators());
+    void getFile(QString filename, QString dstDir, QByteArray expectedHash = QByteArray(), qint64 expectedSize = 0);
+    
+    /// downloaded like getFile, but its failure doesn't fail the batch : optionalFileReceived or optionalFileUnavailable tells its outcome
+    void getOptionalFile(QString filename, QString dstDir, QByteArray expectedHash = QByteArray(), qint64 expectedSize = 0);
+    
+    /**
+     * file downloads failing with a transient error (timeout, connection reset, 5xx http status, hash mismatch)
+     * are retried with an exponential backoff and jitter, up to maxAttempts. other errors (404...) fail the file at once.
+     * a failed file doesn't stop the other downloads, failed is emitted once they are all over
+     */
+    void setRetryPolicy(int maxAttempts, int baseDelayMs = 500, int maxDelayMs = 30000);
+    
+    /**
+     * at most "concurrencyLimit" file downloads are in flight, the other ones wait in a queue.
+     * while downloading, the limit is adjusted every second between minLimit and maxLimit, from the measured throughput
+     * and time to first byte : it grows by one as long as this raises the throughput by 5% at least over the next 2 seconds (and is stepped back otherwise),
+     * it is cut by a quarter when the time to first byte goes over twice the lowest one seen (the requests queue up on the way),
+     * and halved when downloads fail with transient errors (timeouts, connection resets...).
+     * minLimit == maxLimit disables the adjustments
+     */
+    void setConcurrency(int initialLimit = 4, int minLimit = 1, int maxLimit = 16);
+    
+    /// diagnostics of the concurrency controller, measured over the last seconds
+    int concurrencyLimit() const { return _concurrencyLimit; }
+    int inFlightFiles() const { return _inFlight; }
+    qint64 throughput() const { return _throughput; } // bytes per second
+    int latency() const { return _latency; }          // ms to the first byte of a file
+    
+    /// request a file outside of the current download : it isn't part of the progress, allFilesReceived or failed
+    void getLazyFile(QString filename, QString dstDir);
+    
+    /// request an optional manifest file (diff index, version diff...), its absence is not considered a failure
+    void getManifestFile(QString filename, const CacheValidators& validators = CacheValidators());
+    
+    /// validators of the last version json or manifest file received under that name
+    CacheValidators validators(const QString& filename) const { return _validators.value(filename); }
+    
+    /// while a batch is open, allFilesReceived isn't emitted even if no file is pending, as more files may be requested
+    void beginBatch();
+    void endBatch();
+    
+    /// aborts every pending file download, without emitting failed
+    void abortDownloads();
     
     /// get error information
     bool hasFailed() { return _hasFailed; }
     QStringList errors() { return _errors; }
+    QStringList failedFiles() { return _failedFiles; }
     
     /// get progress information
     const std::unordered_map<QString, std::pair<qint64,qint64>>& getDetailedProgress() { return _progress; }
@@ -48,21 +107,80 @@ signals:
     void failed();
     void receivedLastVersion(QByteArray versionJson);
     void allFilesReceived();
+    void receivedManifestFile(QString filename, QByteArray data);
+    void manifestFileUnavailable(QString filename);
+    void manifestFileUnchanged(QString filename); // also for the version json, as "version.json"
+    void aborted();
+    void lazyFileReceived(QString filename, QString dstDir);
+    void lazyFileUnavailable(QString filename, QString dstDir);
+    void optionalFileReceived(QString filename, QString dstDir);    // before the end of the batch, so that
+    void optionalFileUnavailable(QString filename, QString dstDir); // more files can be requested in its place
     
     /// use getDetailedProgress, or getTotalProgress to get the new progress values
     void progressChanged();
+    
+    /// decision of the concurrency controller, reason is "increase", "plateau", "latency" or "errors"
+    void concurrencyChanged(int limit, qint64 throughput, int latencyMs, QString reason);
 
 private slots:
-    void handleVersion(QNetworkReply* reply);
-    void handleFile(QNetworkReply *reply, QString filename, QString dstDir);
+    void handleVersion(TransportReply* reply);
+    void handleFile(TransportReply* reply, QString filename, QString dstDir, QByteArray expectedHash, int attempt);
+    void handleManifestFile(TransportReply* reply, QString filename);
+    void handleLazyFile(TransportReply* reply, QString filename, QString dstDir);
     
 private:
+    struct QueuedFile
+    {
+        QString filename;
+        QString dstDir;
+        QByteArray expectedHash;
+        int attempt;
+    };
+    
+    void requestFile(QString filename, QString dstDir, QByteArray expectedHash, int attempt);
+    void startQueuedFiles();
+    void countReceived(const QString& filename, qint64 bytesReceived);
+    void adjustConcurrency();
+    void finishFiles();
+    int retryDelay(int attempt) const;
+    bool writeFile(const QString& filename, const QByteArray& data);
+    
     std::unordered_map<QString, std::pair<qint64,qint64>> _progress;    
-	QNetworkAccessManager* manager;
+    UpdaterTransport* _transport;
     size_t nbFilesPending;
-    QString _baseUrl;
+    size_t nbBatchFiles;
+    bool _batchOpen;
     bool _hasFailed;
     QStringList _errors;
+    QStringList _failedFiles;
+    QSet<QString> _optionalFiles; // dstDir/filename
+    QHash<QString, qint64> _expectedSizes; // of the pending files, kept across retries
+    int _maxAttempts;
+    int _baseRetryDelay;
+    int _maxRetryDelay;
+    int _generation;
+    QHash<QString, CacheValidators> _validators;
+    
+    // concurrency controller, the window is the current second of downloads
+    QList<QueuedFile> _queuedFiles;
+    int _inFlight;
+    int _concurrencyLimit;
+    int _minConcurrency;
+    int _maxConcurrency;
+    QTimer* _concurrencyTimer;
+    QElapsedTimer _windowTimer;
+    qint64 _windowBytes;
+    qint64 _windowLatency;            // sum of the samples
+    int _windowLatencySamples;
+    int _windowErrors;
+    bool _windowSaturated;            // files waited for a slot
+    qint64 _throughput;               // smoothed over the windows
+    int _latency;
+    int _baseLatency;                 // lowest latency seen, -1 before the first sample
+    qint64 _throughputBeforeIncrease; // smoothed, -1 unless an increase is being measured
+    qint64 _throughputSinceIncrease;  // sum of the raw throughputs of the windows since the increase
+    int _windowsSinceIncrease;
+    int _holdWindows;                 // windows left before trying to increase again after a plateau
 };
 
 #endif // UPDATERCLIENT_H
@@ -0,0 +1,83 @@
+#include "updatertransport.h"
+
+#include <QNetworkAccessManager>
+#include <QNetworkReply>
+
+// =============== UTILITY ===============
+
+// errors that may not happen again : timeouts, connection resets, server side http errors...
+static bool isTransientError(QNetworkReply* reply)
+{
+    int status = reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+    if(status != 0)
+        return status >= 500 || status == 408 || status == 429;
+    switch(reply->error())
+    {
+    case QNetworkReply::NetworkError::ConnectionRefusedError:
+    case QNetworkReply::NetworkError::RemoteHostClosedError:
+    case QNetworkReply::NetworkError::TimeoutError:
+    case QNetworkReply::NetworkError::TemporaryNetworkFailureError:
+    case QNetworkReply::NetworkError::NetworkSessionFailedError:
+    case QNetworkReply::NetworkError::ProxyConnectionRefusedError:
+    case QNetworkReply::NetworkError::ProxyConnectionClosedError:
+    case QNetworkReply::NetworkError::ProxyTimeoutError:
+    case QNetworkReply::NetworkError::UnknownNetworkError:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// =============== TransportReply class ===============
+
+void TransportReply::finish(Error error, const QString& errorString, const QByteArray& data, const QByteArray& writtenHash)
+{
+    if(_finished)
+        return;
+    _finished = true;
+    _error = error;
+    _errorString = errorString;
+    _data = data;
+    _writtenHash = writtenHash;
+    emit finished();
+}
+
+// =============== HttpTransport class ===============
+
+HttpTransport::HttpTransport(QObject* parent, const QString& baseUrl)
+:   UpdaterTransport(parent)
+,   _manager(new QNetworkAccessManager(this))
+,   _baseUrl(baseUrl)
+{
+    connect(_manager, &QNetworkAccessManager::authenticationRequired            , this, [this](){ emit transportError("QNetworkAccessManager::authenticationRequired"); });
+    connect(_manager, &QNetworkAccessManager::preSharedKeyAuthenticationRequired, this, [this](){ emit transportError("QNetworkAccessManager::preSharedKeyAuthenticationRequired"); });
+    connect(_manager, &QNetworkAccessManager::proxyAuthenticationRequired       , this, [this](){ emit transportError("QNetworkAccessManager::proxyAuthenticationRequired"); });
+    connect(_manager, &QNetworkAccessManager::networkAccessibleChanged          , this, [this](){ emit transportError("QNetworkAccessManager::networkAccessibleChanged"); });
+    connect(_manager, &QNetworkAccessManager::sslErrors                         , this, [this](){ emit transportError("QNetworkAccessManager::sslErrors"); });
+    connect(_manager, &QNetworkAccessManager::encrypted                         , this, [this](){ emit transportError("QNetworkAccessManager::encrypted"); });
+}
+
+TransportReply* HttpTransport::get(const QString& filename, const QString&, const CacheValidators& validators)
+{
+    QNetworkRequest request(QUrl(_baseUrl + filename));
+    if(!validators.etag.isEmpty())
+        request.setRawHeader("If-None-Match", validators.etag);
+    if(!validators.lastModified.isEmpty())
+        request.setRawHeader("If-Modified-Since", validators.lastModified);
+    QNetworkReply* networkReply = _manager->get(request);
+    TransportReply* reply = new TransportReply(this);
+    connect(networkReply, &QNetworkReply::downloadProgress, reply, &TransportReply::setProgress);
+    connect(reply, &TransportReply::abortRequested, networkReply, &QNetworkReply::abort);
+    connect(networkReply, &QNetworkReply::finished, reply, [=](){
+        networkReply->deleteLater();
+        int status = networkReply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+        reply->setValidators({networkReply->rawHeader("ETag"), networkReply->rawHeader("Last-Modified")}, status == 304);
+        if(networkReply->error() == QNetworkReply::NetworkError::NoError)
+            reply->finish(TransportReply::NoError, QString(), networkReply->readAll());
+        else if(networkReply->error() == QNetworkReply::NetworkError::OperationCanceledError)
+            reply->finish(TransportReply::CanceledError, networkReply->errorString());
+        else
+            reply->finish(isTransientError(networkReply) ? TransportReply::TransientError : TransportReply::PermanentError, networkReply->errorString());
+    });
+    return reply;
+}
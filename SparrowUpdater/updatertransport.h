@@ -0,0 +1,105 @@
+#ifndef UPDATERTRANSPORT_H
+#define UPDATERTRANSPORT_H
+
+#include <QObject>
+#include <QByteArray>
+
+class QNetworkAccessManager;
+
+/// http cache validators of a file, to only get it again if it changed
+struct CacheValidators
+{
+    QByteArray etag;
+    QByteArray lastModified;
+    bool isEmpty() const { return etag.isEmpty() && lastModified.isEmpty(); }
+};
+
+/**
+ * @brief The TransportReply class is the answer of an UpdaterTransport to a request
+ *
+ * finished is emitted once, the receiver deletes the reply (deleteLater)
+ */
+class TransportReply : public QObject
+{
+    Q_OBJECT
+public:
+    enum Error { NoError, TransientError, PermanentError, CanceledError };
+
+    explicit TransportReply(QObject* parent) : QObject(parent), _error(NoError), _notModified(false), _finished(false) {}
+
+    Error error() const { return _error; }
+    QString errorString() const { return _errorString; }
+    /// content of the file, empty if the transport wrote it to its destination itself
+    QByteArray data() const { return _data; }
+    /// sha1 of the file, only set if the transport wrote it to its destination itself
+    QByteArray writtenHash() const { return _writtenHash; }
+    /// validators of the file, and whether it is unchanged since the validators of the request (it has no data then)
+    CacheValidators validators() const { return _validators; }
+    bool notModified() const { return _notModified; }
+
+    /// transport side, sets the result and emits finished, only the first call counts
+    void finish(Error error, const QString& errorString = QString(), const QByteArray& data = QByteArray(), const QByteArray& writtenHash = QByteArray());
+    void setProgress(qint64 bytesReceived, qint64 bytesTotal) { emit progress(bytesReceived, bytesTotal); }
+    void setValidators(const CacheValidators& validators, bool notModified) { _validators = validators; _notModified = notModified; }
+
+public slots:
+    /// the reply then finishes with CanceledError
+    void abort() { if(!_finished) emit abortRequested(); }
+
+signals:
+    void progress(qint64 bytesReceived, qint64 bytesTotal);
+    void finished();
+    void abortRequested();
+
+private:
+    Error      _error;
+    QString    _errorString;
+    QByteArray _data;
+    QByteArray _writtenHash;
+    CacheValidators _validators;
+    bool       _notModified;
+    bool       _finished;
+};
+
+/**
+ * @brief The UpdaterTransport class is the way UpdaterClient reaches the update server
+ *
+ * filenames are relative to the root of the server
+ */
+class UpdaterTransport : public QObject
+{
+    Q_OBJECT
+public:
+    explicit UpdaterTransport(QObject* parent) : QObject(parent) {}
+    virtual ~UpdaterTransport() {}
+
+    /**
+     * requests a file of the server
+     * dstPath is the absolute path the file is going to be written to, if any : transports able to copy it there
+     * without going through memory do so, and report its hash instead of its data (see TransportReply::writtenHash)
+     * with validators, the reply is only "not modified" if the file didn't change since
+     */
+    virtual TransportReply* get(const QString& filename, const QString& dstPath = QString(), const CacheValidators& validators = CacheValidators()) = 0;
+
+signals:
+    /// errors that are not tied to a request (authentication...)
+    void transportError(QString error);
+};
+
+/**
+ * @brief The HttpTransport class reaches the update server through HTTP
+ */
+class HttpTransport : public UpdaterTransport
+{
+    Q_OBJECT
+public:
+    HttpTransport(QObject* parent, const QString& baseUrl);
+
+    TransportReply* get(const QString& filename, const QString& dstPath = QString(), const CacheValidators& validators = CacheValidators()) override;
+
+private:
+    QNetworkAccessManager* _manager;
+    QString                _baseUrl;
+};
+
+#endif // UPDATERTRANSPORT_H
@@ -0,0 +1,245 @@
+#include "verificationsnapshot.h"
+
+#include "manifest.h"
+
+#include <QFileSystemWatcher>
+#include <QFileInfo>
+#include <QDir>
+#include <QDateTime>
+
+// =============== UTILITY ===============
+
+static QPair<qint64,qint64> fileStamp(const QString& path)
+{
+    QFileInfo info(path);
+    if(!info.exists())
+        return {-1, -1};
+    return {info.size(), info.lastModified().toMSecsSinceEpoch()};
+}
+
+// =============== VerificationSnapshot class ===============
+
+VerificationSnapshot::VerificationSnapshot(QObject* parent, const QString& rootDir)
+:   QObject(parent)
+,   _rootDir(rootDir + '/')
+,   _manifest(nullptr)
+,   _watcher(new QFileSystemWatcher(this))
+{
+    connect(_watcher, &QFileSystemWatcher::fileChanged, this, &VerificationSnapshot::handleFileChanged);
+    connect(_watcher, &QFileSystemWatcher::directoryChanged, this, &VerificationSnapshot::handleDirectoryChanged);
+}
+
+void VerificationSnapshot::reset(const Manifest* manifest, const Manifest* previous)
+{
+    std::vector<quint8> previousStates;
+    std::vector<bool> previousWatched;
+    QHash<int, QPair<qint64,qint64>> previousUnwatchable;
+    previousStates.swap(_states);
+    previousWatched.swap(_watched);
+    previousUnwatchable.swap(_unwatchableFiles);
+    if(!previous || previousStates.size() != size_t(previous->count()))
+        previous = nullptr; // nothing to carry over
+
+    _manifest = manifest;
+    _states.assign(size_t(manifest->count()), Dirty);
+    _watched.assign(size_t(manifest->count()), false);
+    _dirtyFiles.clear();
+    _invalidFiles.clear();
+    _changedFiles.clear();
+    _pendingFiles.clear();
+    _folderFiles.clear();
+
+    for(int i=0; i<manifest->count(); ++i)
+    {
+        QString path = manifest->path(i);
+        _folderFiles[QFileInfo(_rootDir + path).absolutePath()].push_back(i);
+
+        // identical files keep their state, and their watch
+        int j = previous ? previous->indexOf(path) : -1;
+        if(j >= 0 && previousWatched[size_t(j)])
+            _watched[size_t(i)] = true;
+        else if(j >= 0 && previousUnwatchable.contains(j))
+            _unwatchableFiles[i] = previousUnwatchable[j];
+        else
+            _pendingFiles.insert(i);
+        if(j >= 0 && previousStates[size_t(j)] != Dirty
+        && previous->fileSize(j) == manifest->fileSize(i) && previous->digest(j) == manifest->digest(i))
+        {
+            _states[size_t(i)] = previousStates[size_t(j)];
+            if(_states[size_t(i)] == Invalid)
+                _invalidFiles.insert(i);
+        }
+        else
+            _dirtyFiles.insert(i);
+    }
+
+    // the watched folders of the previous manifest are kept, the watched files that are gone are released
+    for(auto it = _folderFiles.cbegin(); it != _folderFiles.cend(); ++it)
+        if(!_watchedFolders.contains(it.key()))
+            _pendingFolders.insert(it.key());
+    QStringList releasedFiles;
+    for(int j=0; previous && j<previous->count(); ++j)
+        if(previousWatched[size_t(j)] && manifest->indexOf(previous->path(j)) < 0)
+            releasedFiles << _rootDir + previous->path(j);
+    if(!releasedFiles.isEmpty())
+        _watcher->removePaths(releasedFiles);
+}
+
+void VerificationSnapshot::setState(int i, State state)
+{
+    quint8& current = _states[size_t(i)];
+    if(current == Dirty)
+        _dirtyFiles.remove(i);
+    else if(current == Invalid)
+        _invalidFiles.remove(i);
+
+    current = state;
+    if(state == Dirty)
+        _dirtyFiles.insert(i);
+    else if(state == Invalid)
+        _invalidFiles.insert(i);
+    if(state != Dirty && _unwatchableFiles.contains(i))
+        _unwatchableFiles[i] = fileStamp(_rootDir + _manifest->path(i));
+}
+
+void VerificationSnapshot::refresh()
+{
+    if(!_manifest)
+        return;
+
+    // folders first, so the creation of missing files is noticed.
+    // a missing folder is replaced by the watch of its nearest existing parent, which puts it back in the pending folders when it changes
+    QStringList folders;
+    for(const QString& folder : _pendingFolders.values())
+    {
+        if(QFileInfo(folder).isDir())
+        {
+            folders << folder;
+            continue;
+        }
+        _pendingFolders.remove(folder);
+        QString parent = folder;
+        while(!QFileInfo(parent).isDir() && !QDir(parent).isRoot())
+            parent = QFileInfo(parent).absolutePath();
+        if(!_watchedFolders.contains(parent) && _watcher->addPath(parent))
+            _watchedFolders.insert(parent);
+    }
+    if(!folders.isEmpty())
+    {
+        QStringList failed = _watcher->addPaths(folders);
+        QSet<QString> failedFolders(failed.begin(), failed.end());
+        for(const QString& folder : folders)
+        {
+            if(failedFolders.contains(folder))
+                continue;
+            _pendingFolders.remove(folder);
+            _watchedFolders.insert(folder);
+            for(int i : _folderFiles.value(folder)) // created while the folder was missing
+            {
+                if(!_watched[size_t(i)] && !_pendingFiles.contains(i) && !_unwatchableFiles.contains(i))
+                {
+                    _pendingFiles.insert(i);
+                    markChanged(i);
+                }
+            }
+        }
+    }
+
+    if(!_pendingFiles.isEmpty())
+    {
+        watchFiles(_pendingFiles.values());
+        _pendingFiles.clear();
+    }
+
+    // files that can't be watched are compared to their last known size and modification time
+    for(auto it = _unwatchableFiles.begin(); it != _unwatchableFiles.end(); ++it)
+    {
+        QPair<qint64,qint64> stamp = fileStamp(_rootDir + _manifest->path(it.key()));
+        if(stamp != it.value())
+        {
+            it.value() = stamp;
+            if(state(it.key()) != Dirty)
+            {
+                _states[size_t(it.key())] = Dirty;
+                _invalidFiles.remove(it.key());
+                _dirtyFiles.insert(it.key());
+            }
+            _changedFiles.insert(it.key());
+        }
+    }
+}
+
+QSet<int> VerificationSnapshot::takeChangedFiles()
+{
+    QSet<int> changedFiles;
+    changedFiles.swap(_changedFiles);
+    return changedFiles;
+}
+
+void VerificationSnapshot::markChanged(int i)
+{
+    setState(i, Dirty);
+    _changedFiles.insert(i);
+}
+
+void VerificationSnapshot::watchFiles(const QList<int>& files)
+{
+    QStringList paths;
+    for(int i : files)
+        paths << _rootDir + _manifest->path(i);
+    QStringList failed = _watcher->addPaths(paths);
+    QSet<QString> failedPaths(failed.begin(), failed.end());
+    for(int i : files)
+    {
+        QString path = _rootDir + _manifest->path(i);
+        QString folder = QFileInfo(path).absolutePath();
+        _watched[size_t(i)] = !failedPaths.contains(path);
+        if(_watched[size_t(i)])
+            _unwatchableFiles.remove(i);
+        else if(!QFileInfo::exists(path) && (_watchedFolders.contains(folder) || _pendingFolders.contains(folder)))
+            _unwatchableFiles.remove(i); // missing, its creation is noticed through the watch of its folder
+        else
+            _unwatchableFiles[i] = fileStamp(path);
+    }
+}
+
+void VerificationSnapshot::handleFileChanged(const QString& path)
+{
+    int i = _manifest && path.startsWith(_rootDir) ? _manifest->indexOf(path.mid(_rootDir.size())) : -1;
+    if(i < 0)
+        return;
+
+    // a replaced or removed file is no longer watched, so the watch is always renewed
+    markChanged(i);
+    _watcher->removePath(path);
+    watchFiles({i});
+    emit filesChanged();
+}
+
+void VerificationSnapshot::handleDirectoryChanged(const QString& path)
+{
+    if(!QFileInfo(path).isDir())
+    {
+        // removed, the watcher released it
+        _watchedFolders.remove(path);
+        if(_folderFiles.contains(path))
+            _pendingFolders.insert(path);
+    }
+    bool changed = false;
+    for(int i : _folderFiles.value(path))
+    {
+        if(_watched[size_t(i)] && QFileInfo::exists(_rootDir + _manifest->path(i)))
+            continue;
+        markChanged(i);
+        watchFiles({i});
+        changed = true;
+    }
+
+    // new sub folders may contain files of the manifest
+    for(auto it = _folderFiles.cbegin(); it != _folderFiles.cend(); ++it)
+        if(it.key().startsWith(path + '/') && !_watchedFolders.contains(it.key()))
+            _pendingFolders.insert(it.key());
+
+    if(changed)
+        emit filesChanged();
+}
@@ -0,0 +1,77 @@
+#ifndef VERIFICATIONSNAPSHOT_H
+#define VERIFICATIONSNAPSHOT_H
+
+#include <QObject>
+#include <QSet>
+#include <QHash>
+#include <vector>
+
+class Manifest;
+class QFileSystemWatcher;
+
+/**
+ * @brief The VerificationSnapshot class remembers which files of a manifest match the local files
+ *
+ * once verified, the files and their folders are watched, and only the files touched since are marked dirty,
+ * so that a new verification only needs to hash the dirty files.
+ * files that can't be watched (the OS limits the number of watches) are compared to their size and modification time instead,
+ * missing files are noticed through the watch of their folder, or of its nearest existing parent
+ */
+class VerificationSnapshot : public QObject
+{
+    Q_OBJECT
+public:
+    enum State : quint8 { Dirty, Valid, Invalid };
+
+    VerificationSnapshot(QObject* parent, const QString& rootDir);
+
+    /**
+     * binds the snapshot to a manifest (which must outlive it or the next reset), every file is dirty
+     * except the files identical in the previous manifest, that keep their state
+     */
+    void reset(const Manifest* manifest, const Manifest* previous = nullptr);
+
+    State state(int i) const { return State(_states[size_t(i)]); }
+    void setState(int i, State state);
+
+    /// O(1) queries
+    bool isUnknown() const { return !_states.empty() && _dirtyFiles.size() == int(_states.size()); }
+    bool isDirty() const { return !_dirtyFiles.isEmpty(); }
+    const QSet<int>& dirtyFiles() const { return _dirtyFiles; }
+    const QSet<int>& invalidFiles() const { return _invalidFiles; }
+
+    /**
+     * watches the files and folders that are not watched yet, and marks the changed unwatchable files dirty
+     * it only has work to do if needsRefresh() is true
+     */
+    bool needsRefresh() const { return !_pendingFiles.isEmpty() || !_pendingFolders.isEmpty() || !_unwatchableFiles.isEmpty(); }
+    void refresh();
+
+    /// files marked dirty by the watch or by refresh() since the last call : the results of a verification that ran meanwhile are outdated for them
+    QSet<int> takeChangedFiles();
+
+signals:
+    void filesChanged();
+
+private:
+    void handleFileChanged(const QString& path);
+    void handleDirectoryChanged(const QString& path);
+    void watchFiles(const QList<int>& files);
+    void markChanged(int i);
+
+    QString                          _rootDir;
+    const Manifest*                  _manifest;
+    std::vector<quint8>              _states;
+    QSet<int>                        _dirtyFiles;
+    QSet<int>                        _invalidFiles;
+    QSet<int>                        _changedFiles;     // see takeChangedFiles
+    QFileSystemWatcher*              _watcher;
+    std::vector<bool>                _watched;
+    QSet<int>                        _pendingFiles;     // not watched yet
+    QSet<QString>                    _pendingFolders;   // not watched yet, absolute paths, missing ones are replaced by the watch of their nearest existing parent
+    QSet<QString>                    _watchedFolders;   // including those parents
+    QHash<int, QPair<qint64,qint64>> _unwatchableFiles; // size and modification time, -1 if the file doesn't exist; missing files are noticed through their folder instead
+    QHash<QString, std::vector<int>> _folderFiles;      // absolute folder path -> files
+};
+
+#endif // VERIFICATIONSNAPSHOT_H
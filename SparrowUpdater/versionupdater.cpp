@@ -3,14 +3,42 @@
 #include <QCoreApplication>
 #include <QDir>
 #include <QJsonDocument>
+#include <QJsonObject>
 #include <QVariantMap>
+#include <QMap>
 #include <QCryptographicHash>
 #include <QProcess>
+#include <QThread>
+#include <QTimer>
+#include <QSaveFile>
+#include <QDateTime>
+#include <algorithm>
 
 #include "updaterclient.h"
+#include "updatertransport.h"
+#include "verificationsnapshot.h"
+#include "instancelock.h"
+#include "rollbackstore.h"
+#include "binarypatch.h"
 
 const QString tmpExe = "tmpExe";
 const QString tmpData = "tmpData";
+const QString tmpLazy = "tmpLazy";
+const QString tmpPatch = "tmpPatch";
+const QString versionFile = "version.json";
+const QString installedVersionFile = "installedVersion.json";
+const QString diffDir = "diffs";
+const QString diffIndexFile = "diffs/index.json";
+const QString quarantineDir = "quarantine";
+const QString patchDir = "patches";
+const QString componentDir = "components";
+const QString stagingDir = "staging";
+const QString readyFile = "ready.json";
+const QString lockFile = "updater.lock";
+const QString statusFile = "updaterStatus.json";
+const QString cacheFile = "updaterCache.json";
+const QString updateScriptFile = "updater.bat";
+const QString rollbackDir = "rollback";
 
 // =============== UTILITY ===============
 
@@ -22,6 +50,26 @@ static void parseDir(QString prefix, QDir dir, QStringList& paths)
         parseDir(prefix + str + "/", QDir(dir.path() + '/' + str), paths);
 };
 
+// files and folders of the app folder that belong to the updater itself
+static bool isUpdaterFile(const QString& path)
+{
+    return path.startsWith(tmpExe + '/') || path.startsWith(tmpData + '/') || path.startsWith(tmpLazy + '/') || path.startsWith(tmpPatch + '/')
+        || path.startsWith(quarantineDir + '/') || path.startsWith(stagingDir + '/') || path.startsWith(rollbackDir + '/')
+        || path == installedVersionFile || path == updateScriptFile || path.startsWith(lockFile) || path == statusFile
+        || path == cacheFile;
+}
+
+// same as parseDir, with file sizes and utf8 paths, skipping the updater files
+static void scanDir(QString prefix, QDir dir, std::vector<std::pair<QByteArray,qint64>>& files)
+{
+    for(QFileInfo info : dir.entryInfoList(QDir::Files))
+        if(!isUpdaterFile(prefix + info.fileName()))
+            files.push_back({(prefix + info.fileName()).toUtf8(), info.size()});
+    for(QString str : dir.entryList(QDir::Dirs | QDir::NoDotAndDotDot))
+        if(!isUpdaterFile(prefix + str + "/"))
+            scanDir(prefix + str + "/", QDir(dir.path() + '/' + str), files);
+}
+
 static bool matchRegexpList(QString file, QStringList list)
 {
     for(QString pattern : list)
@@ -43,20 +91,83 @@ static void computeHash(const QString &fileName, QByteArray& hash, quint64& size
     }
 }
 
-static bool checkFile(const QString &fileName, const QByteArray& ref, const int& refSize)
+// atomically, so that an interrupted write never leaves a truncated version json for the next diff based update
+static bool writeInstalledVersion(const Manifest& manifest)
 {
-    QFile f(fileName);
-    if (f.open(QFile::ReadOnly))
+    QByteArray json = manifest.toJson();
+    QSaveFile installedFile(qApp->applicationDirPath() + '/' + installedVersionFile);
+    return installedFile.open(QFile::WriteOnly) && installedFile.write(json) == json.size() && installedFile.commit();
+}
+
+// file entries of one category ("data" or "exe") of a version json, sorted by path
+struct FileEntry
+{
+    QString hash; // base64, as stored in the json
+    qint64 size;
+    bool operator!=(const FileEntry& other) const { return hash != other.hash || size != other.size; }
+};
+typedef QMap<QString, FileEntry> FileEntries;
+
+static FileEntries readEntries(const QVariantMap& map, const QString& category)
+{
+    FileEntries entries;
+    QStringList files = map[category + "Files"].toStringList();
+    QVariantList hashes = map[category + "Hashs"].toList();
+    QVariantList sizes = map[category + "FileSizes"].toList();
+    for(int i=0; i<files.size() && i<hashes.size() && i<sizes.size(); ++i)
+        entries[files[i]] = {hashes[i].toString(), sizes[i].toLongLong()};
+    return entries;
+}
+
+static void writeEntries(QVariantMap& map, const QString& category, const FileEntries& entries)
+{
+    QVariantList hashes;
+    QVariantList sizes;
+    for(const FileEntry& entry : entries)
     {
-        QByteArray data = f.readAll();
-        if(data.size() != refSize)
-            return false;
-        QCryptographicHash hashFunc(QCryptographicHash::Sha1);
-        hashFunc.addData(data);
-        return ref == hashFunc.result();
+        hashes.push_back(entry.hash);
+        sizes.push_back(entry.size);
     }
-    else
-        return false;
+    map[category + "Files"] = QStringList(entries.keys());
+    map[category + "Hashs"] = hashes;
+    map[category + "FileSizes"] = sizes;
+}
+
+static QVariantMap parseJsonMap(const QByteArray& json, bool* ok = nullptr)
+{
+    QJsonParseError jsonError;
+    QJsonDocument doc = QJsonDocument::fromJson(json, &jsonError);
+    if(ok)
+        *ok = jsonError.error == QJsonParseError::NoError && doc.isObject();
+    return doc.toVariant().toMap();
+}
+
+// breadth first search of the shortest chain of diffs from a version to the latest one in the diff index
+static QStringList shortestDiffChain(const QVariantMap& index, const QString& fromVersion)
+{
+    QString latest = index["latest"].toString();
+    QMultiHash<QString, QPair<QString,QString>> diffs; // from -> (to, diff file)
+    for(QVariant v : index["diffs"].toList())
+    {
+        QVariantMap diff = v.toMap();
+        diffs.insert(diff["from"].toString(), {diff["to"].toString(), diff["file"].toString()});
+    }
+    
+    QHash<QString, QPair<QString,QString>> previous; // version -> (previous version, diff file)
+    QStringList queue = {fromVersion};
+    for(int i=0; i<queue.size() && !previous.contains(latest); ++i)
+        for(auto diff : diffs.values(queue[i]))
+            if(diff.first != fromVersion && !previous.contains(diff.first))
+            {
+                previous[diff.first] = {queue[i], diff.second};
+                queue << diff.first;
+            }
+    
+    QStringList chain;
+    if(previous.contains(latest))
+        for(QString version = latest; version != fromVersion; version = previous[version].first)
+            chain.prepend(previous[version].second);
+    return chain;
 }
 
 // =============== VersionUpdater class ===============
@@ -65,11 +176,50 @@ VersionUpdater::VersionUpdater(QObject* parent, QString baseUrl)
 :   QObject(parent)
 ,   _client(new UpdaterClient(this, baseUrl))
 ,   _currentStep(0)
+,   _remoteVersionSaved(false)
+,   _checkDiffedOnly(false)
+,   _allComponents(true)
+,   _snapshot(new VerificationSnapshot(this, qApp->applicationDirPath()))
+,   _staleFilesPolicy(KeepStaleFiles)
+,   _prefetchSlots(0)
+,   _pollTimer(nullptr)
+,   _staging(false)
+,   _rollback(new RollbackStore(this, qApp->applicationDirPath(), rollbackDir, installedVersionFile))
+,   _lock(new InstanceLock(this, qApp->applicationDirPath(), lockFile, statusFile, updateScriptFile))
+,   _canceled(false)
+,   _verification(0)
 {
     connect(_client, &UpdaterClient::receivedLastVersion, this, &VersionUpdater::handleVersion);
+    connect(_client, &UpdaterClient::receivedManifestFile, this, &VersionUpdater::handleManifestFile);
+    connect(_client, &UpdaterClient::manifestFileUnavailable, this, &VersionUpdater::handleManifestUnavailable);
+    connect(_client, &UpdaterClient::manifestFileUnchanged, this, &VersionUpdater::handleManifestUnchanged);
     connect(_client, &UpdaterClient::allFilesReceived, this, &VersionUpdater::handleFinished);
     connect(_client, &UpdaterClient::progressChanged, this, &VersionUpdater::progressChanged);
+    connect(_client, &UpdaterClient::concurrencyChanged, this, &VersionUpdater::concurrencyChanged);
+    connect(_client, &UpdaterClient::lazyFileReceived, this, [this](QString filename){ handleLazyFile(filename, true); });
+    connect(_client, &UpdaterClient::lazyFileUnavailable, this, [this](QString filename){ handleLazyFile(filename, false); });
+    connect(_client, &UpdaterClient::optionalFileReceived, this, [this](QString filename){ handlePatch(filename, true); });
+    connect(_client, &UpdaterClient::optionalFileUnavailable, this, [this](QString filename){ handlePatch(filename, false); });
     connect(_client, &UpdaterClient::failed, this, [this](){ emit failure(_client->errors()); });
+    connect(this, &VersionUpdater::failure, this, [this](){
+        _staging = false; // the next poll starts over
+        _stagingPrefix.clear();
+        releaseLock("failed");
+    });
+    connect(_client, &UpdaterClient::progressChanged, this, [this](){
+        if(_lock->isLocked())
+            writeStatus("downloading", true);
+    });
+    connect(_lock, &InstanceLock::otherInstanceUpdating, this, &VersionUpdater::otherInstanceUpdating);
+    connect(_lock, &InstanceLock::sharedProgressChanged, this, &VersionUpdater::progressChanged);
+    connect(_lock, &InstanceLock::otherInstanceFinished, this, &VersionUpdater::otherInstanceFinished);
+    connect(_rollback, &RollbackStore::unavailable, this, &VersionUpdater::rollbackUnavailable);
+}
+
+VersionUpdater::~VersionUpdater()
+{
+    stopVerifier();
+    releaseLock(_lock->isRestarting() ? "restarting" : "stopped"); // the update script holds the update until it is done
 }
 
 QStringList VersionUpdater::parseAppFolder(QStringList whitelist, QStringList blacklist)
@@ -79,9 +229,10 @@ QStringList VersionUpdater::parseAppFolder(QStringList whitelist, QStringList bl
     if(filepaths.empty())
         parseDir(QString(), appDir, filepaths);
     
+    // the files written by the updater in a used app folder are never published
     QStringList filteredFilePaths;
     for(QString file : filepaths)
-        if(matchRegexpList(file, whitelist) && !matchRegexpList(file, blacklist))
+        if(!isUpdaterFile(file) && matchRegexpList(file, whitelist) && !matchRegexpList(file, blacklist))
             filteredFilePaths << file;
     return filteredFilePaths;
 }
@@ -145,113 +296,823 @@ QByteArray VersionUpdater::generateVersionJson(QStringList dataFiles, QStringLis
     return QJsonDocument::fromVariant(map).toJson();
 }
 
-void VersionUpdater::getOnlineVersionInfo()
+QByteArray VersionUpdater::generateVersionDiff(QByteArray oldVersionJson, QByteArray newVersionJson)
 {
-    _currentStep = 1;
-    _client->getLastVersion();
+    bool oldOk, newOk;
+    QVariantMap oldVersion = parseJsonMap(oldVersionJson, &oldOk);
+    QVariantMap newVersion = parseJsonMap(newVersionJson, &newOk);
+    if(!oldOk || !newOk)
+        return QByteArray();
+    
+    QVariantMap added, changed, removed;
+    for(QString category : {"data", "exe"})
+    {
+        FileEntries oldEntries = readEntries(oldVersion, category);
+        FileEntries newEntries = readEntries(newVersion, category);
+        FileEntries addedEntries, changedEntries;
+        QStringList removedFiles;
+        for(auto it = newEntries.cbegin(); it != newEntries.cend(); ++it)
+        {
+            auto old = oldEntries.constFind(it.key());
+            if(old == oldEntries.cend())
+                addedEntries[it.key()] = it.value();
+            else if(old.value() != it.value())
+                changedEntries[it.key()] = it.value();
+        }
+        for(auto it = oldEntries.cbegin(); it != oldEntries.cend(); ++it)
+            if(!newEntries.contains(it.key()))
+                removedFiles << it.key();
+        writeEntries(added, category, addedEntries);
+        writeEntries(changed, category, changedEntries);
+        removed[category + "Files"] = removedFiles;
+    }
+    
+    // only the patches of the added and changed files are of use to the clients of the diff
+    QVariantMap patches;
+    QVariantMap newPatches = newVersion["patches"].toMap();
+    for(QVariantMap files : {added, changed})
+        for(QString category : {"data", "exe"})
+            for(QString file : files[category + "Files"].toStringList())
+                if(newPatches.contains(file))
+                    patches[file] = newPatches[file];
+    
+    QVariantMap map;
+    map["from"] = oldVersion["version"];
+    map["to"] = newVersion["version"];
+    map["added"] = added;
+    map["changed"] = changed;
+    map["removed"] = removed;
+    if(!patches.isEmpty())
+        map["patches"] = patches;
+    map["components"] = newVersion["components"].toMap(); // always set, so that removed components are noticed
+    return QJsonDocument::fromVariant(map).toJson();
 }
 
-void VersionUpdater::handleVersion(QByteArray versionJson)
+QByteArray VersionUpdater::generateDiffIndex(QString latestVersion, QByteArrayList versionDiffs, QByteArray latestDigest)
 {
-    // Parsing json
-    QJsonParseError jsonError;
-    QJsonDocument doc = QJsonDocument::fromJson(versionJson, &jsonError);
-    QString version;
-    _remoteDataFiles    .clear();
-    _remoteDataHashes   .clear();
-    _remoteDataFileSizes.clear();
-    _missingDataFiles   .clear();
-    _remoteExeFiles     .clear();
-    _remoteExeHashes    .clear();
-    _remoteExeFileSizes .clear();
-    _missingExeFiles    .clear();
-    _currentStep = 2;
-    if(jsonError.error == QJsonParseError::NoError)
+    QVariantList diffs;
+    for(QByteArray diffJson : versionDiffs)
     {
-        QVariantMap map = doc.toVariant().toMap();
-        version = map["version"].toString();
-        
-        _remoteExeFiles = map["exeFiles"].toStringList();
-        for(QVariant v : map["exeHashs"].toList())
-            _remoteExeHashes.push_back(QByteArray::fromBase64(v.toByteArray()));
-        for(QVariant v : map["exeFileSizes"].toList())
-            _remoteExeFileSizes.push_back(v.toInt());
+        bool ok;
+        QVariantMap diff = parseJsonMap(diffJson, &ok);
+        if(!ok)
+            return QByteArray();
+        QVariantMap entry;
+        entry["from"] = diff["from"];
+        entry["to"] = diff["to"];
+        entry["file"] = diffDir + '/' + diff["from"].toString() + '_' + diff["to"].toString() + ".json";
+        diffs.push_back(entry);
+    }
+    
+    QVariantMap map;
+    map["latest"] = latestVersion;
+    if(!latestDigest.isEmpty())
+        map["latestDigest"] = QString::fromLatin1(latestDigest.toBase64());
+    map["diffs"] = diffs;
+    return QJsonDocument::fromVariant(map).toJson();
+}
+
+bool VersionUpdater::publishVersionJson(QByteArray versionJson, QString publishDir)
+{
+    bool ok;
+    QString latestVersion = parseJsonMap(versionJson, &ok)["version"].toString();
+    if(!ok)
+        return false;
+    QDir dir(publishDir);
+    
+    // diff from the previously published version
+    QFile previousFile(dir.filePath(versionFile));
+    if(previousFile.open(QFile::ReadOnly))
+    {
+        QByteArray previousJson = previousFile.readAll();
+        previousFile.close();
+        QString previousVersion = parseJsonMap(previousJson)["version"].toString();
+        if(!previousVersion.isEmpty() && previousVersion != latestVersion)
+        {
+            QByteArray diffJson = generateVersionDiff(previousJson, versionJson);
+            QFile diffFile(dir.filePath(diffDir + '/' + previousVersion + '_' + latestVersion + ".json"));
+            if(diffJson.isEmpty() || !dir.mkpath(diffDir) || !diffFile.open(QFile::WriteOnly)
+            || diffFile.write(diffJson) != diffJson.size())
+                return false;
+        }
+    }
+    
+    // index of every diff published so far
+    QByteArrayList diffs;
+    for(QString filename : QDir(dir.filePath(diffDir)).entryList({"*.json"}, QDir::Files))
+    {
+        QFile diffFile(dir.filePath(diffDir + '/' + filename));
+        if(diffDir + '/' + filename != diffIndexFile && diffFile.open(QFile::ReadOnly))
+            diffs << diffFile.readAll();
+    }
+    if(!diffs.isEmpty())
+    {
+        QByteArray indexJson = generateDiffIndex(latestVersion, diffs, QCryptographicHash::hash(versionJson, QCryptographicHash::Sha1));
+        QFile indexFile(dir.filePath(diffIndexFile));
+        if(indexJson.isEmpty() || !indexFile.open(QFile::WriteOnly) || indexFile.write(indexJson) != indexJson.size())
+            return false;
+    }
+    
+    QFile file(dir.filePath(versionFile));
+    return file.open(QFile::WriteOnly) && file.write(versionJson) == versionJson.size();
+}
+
+QByteArray VersionUpdater::generatePatches(QByteArray versionJson, QStringList previousReleaseDirs, QStringList patchedFiles, QString publishDir)
+{
+    Manifest manifest;
+    if(!manifest.fromJson(versionJson))
+        return QByteArray();
+    QDir appDir(qApp->applicationDirPath());
+    QDir dir(publishDir);
+    
+    for(int i=0; i<manifest.count(); ++i)
+    {
+        QString path = manifest.path(i);
+        if(!matchRegexpList(path, patchedFiles))
+            continue;
+        QFile targetFile(appDir.filePath(path));
+        if(!targetFile.open(QFile::ReadOnly))
+            return QByteArray();
+        QByteArray target = targetFile.readAll();
         
-        _remoteDataFiles = map["dataFiles"].toStringList();
-        for(QVariant v : map["dataHashs"].toList())
-            _remoteDataHashes.push_back(QByteArray::fromBase64(v.toByteArray()));
-        for(QVariant v : map["dataFileSizes"].toList())
-            _remoteDataFileSizes.push_back(v.toInt());
+        // one patch per distinct older version of the file, keyed by its digest
+        QList<Manifest::Patch> patches;
+        QSet<QByteArray> sources;
+        for(QString releaseDir : previousReleaseDirs)
+        {
+            QFile sourceFile(QDir(releaseDir).filePath(path));
+            if(!sourceFile.open(QFile::ReadOnly))
+                continue; // the file is not part of that release
+            QByteArray source = sourceFile.readAll();
+            QByteArray digest = QCryptographicHash::hash(source, QCryptographicHash::Sha1);
+            if(manifest.digestEquals(i, digest) || sources.contains(digest))
+                continue;
+            sources.insert(digest);
+            
+            QByteArray patch = BinaryPatch::generate(source, target);
+            if(patch.size() >= target.size())
+                continue; // no gain over the full file
+            QString patchFile = patchDir + '/' + path + '.' + QString::fromLatin1(digest.toHex()) + ".patch";
+            QFile file(dir.filePath(patchFile));
+            if(!dir.mkpath(QFileInfo(patchFile).path()) || !file.open(QFile::WriteOnly) || file.write(patch) != patch.size())
+                return QByteArray();
+            patches.append({digest, patchFile, patch.size()});
+        }
+        manifest.setPatches(path, patches);
+    }
+    return manifest.toJson();
+}
+
+QByteArray VersionUpdater::generateComponents(QByteArray versionJson, QMap<QString, QStringList> components, QString publishDir)
+{
+    Manifest manifest;
+    if(!manifest.fromJson(versionJson))
+        return QByteArray();
+    QDir dir(publishDir);
+    
+    QSet<QString> componentFiles;
+    for(auto it = components.cbegin(); it != components.cend(); ++it)
+    {
+        Manifest component;
+        component.setVersion(manifest.version());
+        for(int i=0; i<manifest.count(); ++i)
+        {
+            QString path = manifest.path(i);
+            if(componentFiles.contains(path) || !matchRegexpList(path, it.value()))
+                continue;
+            component.insert(path, manifest.kind(i), manifest.digest(i), manifest.fileSize(i));
+            component.setPatches(path, manifest.patches(path));
+            componentFiles.insert(path);
+        }
         
-        emit onlineVersionReceived(version);
+        QByteArray json = component.toJson();
+        QString componentFile = componentDir + '/' + it.key() + ".json";
+        QFile file(dir.filePath(componentFile));
+        if(!dir.mkpath(componentDir) || !file.open(QFile::WriteOnly) || file.write(json) != json.size())
+            return QByteArray();
+        manifest.setComponent(it.key(), {componentFile, it.value(), QCryptographicHash::hash(json, QCryptographicHash::Sha1)});
     }
-    else
+    manifest.remove(componentFiles);
+    return manifest.toJson();
+}
+
+void VersionUpdater::setInstalledComponents(QStringList components)
+{
+    _installedComponents = QSet<QString>(components.begin(), components.end());
+    _allComponents = false;
+}
+
+bool VersionUpdater::isInstalledComponent(const QString& name) const
+{
+    return _allComponents || _installedComponents.contains(name);
+}
+
+bool VersionUpdater::isSkippedComponentFile(const QString& path) const
+{
+    QString component = fileComponent(path);
+    return !component.isEmpty() && !isInstalledComponent(component);
+}
+
+void VersionUpdater::indexComponents(const QMap<QString, Manifest::Component>& components)
+{
+    QMap<QString, QStringList> componentPaths;
+    for(auto it = components.cbegin(); it != components.cend(); ++it)
+        componentPaths[it.key()] = it.value().paths;
+    if(componentPaths == _componentPaths)
+        return; // the files keep their component
+    _componentPaths = componentPaths;
+    _fileComponents.clear();
+}
+
+QString VersionUpdater::fileComponent(const QString& path) const
+{
+    if(_componentPaths.isEmpty())
+        return QString();
+    auto found = _fileComponents.constFind(path);
+    if(found != _fileComponents.cend())
+        return found.value();
+    
+    // a file goes to the first matching component, like in generateComponents
+    QString name;
+    for(auto it = _componentPaths.cbegin(); it != _componentPaths.cend() && name.isEmpty(); ++it)
+        if(matchRegexpList(path, it.value()))
+            name = it.key();
+    if(!name.isEmpty())
+        _fileComponents.insert(path, name); // only the few component files, the others are matched again
+    return name;
+}
+
+void VersionUpdater::restartWithUpdateScript()
+{
+    // the lock is held until the app quits, and the script keeps the other instances waiting until it is done
+    _lock->holdForUpdateScript();
+    writeStatus("restarting");
+}
+
+void VersionUpdater::releaseLock(const QString& state)
+{
+    _lock->release(state, _remoteManifest.version(), _client->getTotalProgress());
+}
+
+void VersionUpdater::writeStatus(const QString& state, bool throttled)
+{
+    _lock->writeStatus(state, _remoteManifest.version(), _client->getTotalProgress(), throttled);
+}
+
+void VersionUpdater::getOnlineVersionInfo()
+{
+    if(_lock->isFollowing() || !_lock->acquire())
     {
-        emit failure({"Json parsing error : " + jsonError.errorString()});
+        _staging = false; // the other instance does the work
         return;
     }
+    writeStatus("checking");
+    _currentStep = 1;
+    _pendingDiffs.clear();
+    _pendingComponents.clear();
+    _diffedFiles.clear();
+    _removedFiles.clear();
+    _manifestValidators.clear();
+    _cache.clear();
+    _onlineDigest.clear();
+    
+    QFile installedFile(qApp->applicationDirPath() + '/' + installedVersionFile);
+    if(installedFile.open(QFile::ReadOnly) && _diffedManifest.fromJson(installedFile.readAll()))
+    {
+        QFile cache(qApp->applicationDirPath() + '/' + cacheFile);
+        if(cache.open(QFile::ReadOnly))
+            _cache = QJsonDocument::fromJson(cache.readAll()).toVariant().toMap();
+        if(_cache["version"].toString() != _diffedManifest.version())
+            _cache.clear(); // saved with another installed version
+        rememberInstalledComponents();
+        _client->getManifestFile(diffIndexFile, cachedValidators(diffIndexFile));
+    }
+    else
+        getFullVersion();
 }
 
-bool VersionUpdater::checkFiles()
+void VersionUpdater::getFullVersion()
 {
-    bool filesOk = true;
- 
-    assert(_currentStep > 1); // try waiting for the onlineVersionReceived signal before calling this method
+    _pendingDiffs.clear();
+    _pendingComponents.clear();
+    _diffedManifest.clear();
+    _client->getLastVersion(cachedValidators(versionFile));
+}
+
+void VersionUpdater::handleManifestFile(QString filename, QByteArray data)
+{
+    if(_currentStep != 1)
+        return;
+    if(_pendingComponents.contains(filename))
+    {
+        handleComponent(filename, data);
+        return;
+    }
+    if(filename == diffIndexFile && isCachedManifest(filename, data))
+    {
+        handleManifestUnchanged(filename); // served again without validators
+        return;
+    }
     
-    if(_missingDataFiles.empty())
+    QJsonParseError jsonError;
+    QJsonDocument doc = QJsonDocument::fromJson(data, &jsonError);
+    bool ok = jsonError.error == QJsonParseError::NoError && doc.isObject();
+    if(filename == diffIndexFile)
     {
-        // checking data
-        for(int i=0; i<_remoteDataFiles.size(); ++i)
+        // following the shortest chain of diffs, or doing nothing if already up to date
+        QVariantMap index = doc.toVariant().toMap();
+        _onlineDigest = index["latestDigest"].toString();
+        if(ok && index["latest"].toString() != _diffedManifest.version())
         {
-            QString filename = _remoteDataFiles[i];
-            qint64 size = _remoteDataFileSizes[i];
-            if(!checkFile(filename, _remoteDataHashes[i], size))
-            {
-                filesOk = false;
-                _missingDataFiles.push_back({filename, size});
-            }
+            _pendingDiffs = shortestDiffChain(index, _diffedManifest.version());
+            ok = !_pendingDiffs.isEmpty();
+        }
+        else if(ok)
+        {
+            // the version can be published again with other files, only the digest tells, the full version json is checked otherwise
+            ok = !_onlineDigest.isEmpty() && _onlineDigest == _cache["versionDigest"].toString();
         }
+        if(ok)
+            rememberManifest(filename, data, index["latest"].toString());
+    }
+    else if(!_pendingDiffs.isEmpty() && filename == _pendingDiffs.first())
+    {
+        ok = ok && _diffedManifest.applyDiff(doc.object(), _diffedFiles, &_removedFiles);
+        _pendingDiffs.removeFirst();
+    }
+    else
+        return;
+    
+    if(!ok)
+        getFullVersion();
+    else if(!_pendingDiffs.isEmpty())
+        _client->getManifestFile(_pendingDiffs.first());
+    else
+    {
+        _checkDiffedOnly = true;
+        loadComponents();
+    }
+}
+
+void VersionUpdater::handleManifestUnavailable(QString filename)
+{
+    if(_currentStep != 1)
+        return;
+    if(_pendingComponents.contains(filename))
+    {
+        _pendingComponents.clear();
+        _currentStep = 0; // the replies of the other components are ignored
+        emit failure({tr("Component manifest unavailable : %1").arg(filename)});
     }
     else
-        filesOk = false;
+        getFullVersion();
+}
+
+void VersionUpdater::handleManifestUnchanged(QString filename)
+{
+    if(_currentStep != 1 || (filename != diffIndexFile && filename != versionFile))
+        return;
+    QVariantMap entry = _cache["files"].toMap()[filename].toMap();
+    QFile installedFile(qApp->applicationDirPath() + '/' + installedVersionFile);
+    if(entry.isEmpty() || !installedFile.open(QFile::ReadOnly) || !_diffedManifest.fromJson(installedFile.readAll()))
+    {
+        _cache.clear(); // the full version json is downloaded without validators
+        getFullVersion();
+        return;
+    }
+    rememberInstalledComponents();
+    if(!_manifestValidators.contains(filename))
+        _manifestValidators[filename] = entry;
+    _onlineDigest = _cache["versionDigest"].toString();
     
-    if(_missingExeFiles.empty())
+    // the online version is still the installed one, only the files changed on disk since the record are checked
+    _pendingDiffs.clear();
+    _pendingComponents.clear();
+    _diffedFiles.clear();
+    _removedFiles.clear();
+    _checkDiffedOnly = true;
+    if(_cache["components"].toString() == componentSelection())
+        finishOnlineVersion(); // the installed version already has the files of the installed components
+    else
+        loadComponents();
+}
+
+void VersionUpdater::rememberInstalledComponents()
+{
+    // the components of the installed version whose files were all installed along with it
+    _installedComponentDigests.clear();
+    QStringList selection = _cache["components"].toString().split(',', Qt::SkipEmptyParts);
+    const QMap<QString, Manifest::Component>& components = _diffedManifest.components();
+    for(auto it = components.cbegin(); it != components.cend(); ++it)
+        if(selection.contains("*") || selection.contains(it.key()))
+            _installedComponentDigests[it.key()] = it.value().digest;
+}
+
+void VersionUpdater::loadComponents()
+{
+    indexComponents(_diffedManifest.components());
+    const QMap<QString, Manifest::Component>& components = _diffedManifest.components();
+    
+    // the sub-manifests unchanged since the installed version aren't fetched again, the installed version still lists their files
+    QSet<QString> keptComponents;
+    for(auto it = components.cbegin(); _checkDiffedOnly && it != components.cend(); ++it)
+        if(isInstalledComponent(it.key()) && _installedComponentDigests.value(it.key()) == it.value().digest)
+            keptComponents.insert(it.key());
+    
+    // the other component files left from the installed version are only kept if their sub-manifest still lists them
+    QSet<QString> componentFiles;
+    for(int i=0; _checkDiffedOnly && i<_diffedManifest.count(); ++i)
     {
-        // checking exe
-        for(int i=0; i<_remoteExeFiles.size(); ++i)
+        QString component = fileComponent(_diffedManifest.path(i));
+        if(!component.isEmpty() && !keptComponents.contains(component))
+            componentFiles.insert(_diffedManifest.path(i));
+    }
+    if(_checkDiffedOnly)
+        _installedManifest = _diffedManifest;
+    _diffedManifest.remove(componentFiles);
+    
+    for(auto it = components.cbegin(); it != components.cend(); ++it)
+        if(isInstalledComponent(it.key()) && !keptComponents.contains(it.key()))
+            _pendingComponents[it.value().file] = it.key();
+    if(_pendingComponents.isEmpty())
+        finishOnlineVersion();
+    for(QString file : _pendingComponents.keys())
+        _client->getManifestFile(file);
+}
+
+void VersionUpdater::handleComponent(QString filename, const QByteArray& data)
+{
+    QString name = _pendingComponents.take(filename);
+    Manifest component;
+    if(QCryptographicHash::hash(data, QCryptographicHash::Sha1) != _diffedManifest.components().value(name).digest
+    || !component.fromJson(data))
+    {
+        _pendingComponents.clear();
+        _currentStep = 0;
+        emit failure({tr("Invalid component manifest : %1").arg(filename)});
+        return;
+    }
+    
+    for(int i=0; i<component.count(); ++i)
+    {
+        QString path = component.path(i);
+        _diffedManifest.insert(path, component.kind(i), component.digest(i), component.fileSize(i));
+        _diffedManifest.setPatches(path, component.patches(path));
+        
+        // like the files of the diffs, only the component files that changed since the installed version are checked
+        int j = _installedManifest.indexOf(path);
+        if(_checkDiffedOnly && (j < 0 || _installedManifest.fileSize(j) != component.fileSize(i) || !_installedManifest.digestEquals(j, component.digest(i))))
+            _diffedFiles.insert(path);
+    }
+    if(_pendingComponents.isEmpty())
+        finishOnlineVersion();
+}
+
+void VersionUpdater::finishOnlineVersion()
+{
+    loadManifest(std::move(_diffedManifest));
+    _diffedManifest.clear();
+    QVariantMap record = _cache.take("record").toMap(); // one entry per file, not kept in memory once used
+    if(record.isEmpty())
+        _checkDiffedOnly = false; // the installed version was written before its files were (update script, rollback...), every file is checked
+    if(_checkDiffedOnly)
+    {
+        // files that changed on disk since the installed version was recorded are checked too
+        QString appDir = qApp->applicationDirPath() + '/';
+        for(int i=0; i<_remoteManifest.count(); ++i)
         {
-            QString filename = _remoteExeFiles[i];
-            qint64 size = _remoteExeFileSizes[i];
-            if(!checkFile(filename, _remoteExeHashes[i], _remoteExeFileSizes[i]))
-            {
-                filesOk = false;
-                _missingExeFiles.push_back({filename, size});
-            }
+            QVariantList stat = record.value(_remoteManifest.path(i)).toList();
+            QFileInfo info(appDir + _remoteManifest.path(i));
+            if(stat.size() != 2 || stat[0].toLongLong() != info.size() || stat[1].toLongLong() != info.lastModified().toMSecsSinceEpoch())
+                _diffedFiles.insert(_remoteManifest.path(i));
+        }
+        for(QString file : _diffedFiles)
+        {
+            int i = _remoteManifest.indexOf(file);
+            if(i >= 0) // can be removed by a later diff of the chain
+                _filesToCheck.push_back(i);
         }
+        // files of the installed version that are gone, including the files of the components removed from the online version
+        for(int j=0; j<_installedManifest.count(); ++j)
+            if(_remoteManifest.indexOf(_installedManifest.path(j)) < 0 && !isSkippedComponentFile(_installedManifest.path(j)))
+                _removedFiles.insert(_installedManifest.path(j));
+    }
+    _installedManifest.clear();
+    emit onlineVersionReceived(_remoteManifest.version());
+    if(_staging)
+        stageOnlineVersion();
+}
+
+void VersionUpdater::handleVersion(QByteArray versionJson)
+{
+    if(isCachedManifest(versionFile, versionJson))
+    {
+        handleManifestUnchanged(versionFile); // served again without validators
+        return;
+    }
+    
+    // Parsing json
+    _onlineDigest = QString::fromLatin1(QCryptographicHash::hash(versionJson, QCryptographicHash::Sha1).toBase64());
+    QString jsonError;
+    bool ok = _diffedManifest.fromJson(versionJson, &jsonError);
+    _checkDiffedOnly = false;
+    if(ok)
+    {
+        rememberManifest(versionFile, versionJson, _diffedManifest.version());
+        loadComponents();
     }
     else
-        filesOk = false;
+    {
+        loadManifest(std::move(_diffedManifest));
+        _diffedManifest.clear();
+        emit failure({"Json parsing error : " + jsonError});
+    }
+}
+
+void VersionUpdater::loadManifest(Manifest&& manifest)
+{
+    Manifest previousManifest = std::move(_remoteManifest);
+    _remoteManifest = std::move(manifest);
+    indexComponents(_remoteManifest.components());
+    ++_verification; // a running verification reports indexes of the previous manifest, it is dropped
+    _canceled = true;
+    _snapshot->reset(&_remoteManifest, &previousManifest);
+    _remoteVersionSaved = false;
     
+    // the snapshot may spare the next check a full reconcile, so the files the new version dropped are added to the stale files here
+    if(_staleFilesPolicy != KeepStaleFiles)
+    {
+        QString appDir = qApp->applicationDirPath() + '/';
+        for(int j=0; j<previousManifest.count(); ++j)
+            if(isStaleFile(previousManifest.path(j)) && QFileInfo::exists(appDir + previousManifest.path(j)))
+                _staleFiles << previousManifest.path(j);
+        _staleFiles.removeDuplicates();
+        refreshStaleFiles();
+    }
+    _filesToCheck.clear();
+    _missingFiles.clear();
+    _lazyFiles.clear();
+    _fetchingFiles.clear();
+    _unavailableFiles.clear();
+    _currentStep = 2;
+}
+
+bool VersionUpdater::checkFiles()
+{
+    assert(_currentStep > 1); // try waiting for the onlineVersionReceived signal before calling this method
+    
+    if(_snapshot->needsRefresh())
+        _snapshot->refresh();
+    _snapshot->takeChangedFiles(); // already dirty, they are verified now
+    if(_snapshot->isUnknown())
+        storeVerification(verifyFiles(_remoteManifest, _filesToCheck, _removedFiles, _checkDiffedOnly));
+    else if(_snapshot->isDirty())
+        checkDirtyFiles();
+    bool filesOk = _missingFiles.empty();
+    if(filesOk && _lazyFiles.isEmpty())
+        saveInstalledVersion();
+    if(filesOk)
+        releaseLock("upToDate");
     return filesOk;
 }
 
+const std::vector<int>& VersionUpdater::missingFiles()
+{
+    checkFiles();
+    return _missingFiles;
+}
+
 std::vector<std::pair<QString,qint64>> VersionUpdater::filesToUpdate()
 {
     std::vector<std::pair<QString,qint64>> missingFiles;
+    for(int i : this->missingFiles())
+        missingFiles.push_back({_remoteManifest.path(i), _remoteManifest.fileSize(i)});
+    return missingFiles;
+}
+
+VersionUpdater::Reconciliation VersionUpdater::reconcileFiles()
+{
+    assert(_currentStep > 1); // try waiting for the onlineVersionReceived signal before calling this method
+    return reconcile(_remoteManifest);
+}
+
+VersionUpdater::Reconciliation VersionUpdater::reconcile(const Manifest& manifest, const std::function<void(int)>& onMissing, const std::atomic<bool>* canceled)
+{
+    Reconciliation reconciliation;
+    QString appDir = qApp->applicationDirPath() + '/';
+    std::vector<std::pair<QByteArray,qint64>> localFiles;
+    scanDir(QString(), QDir(appDir), localFiles);
+    std::sort(localFiles.begin(), localFiles.end());
+    std::vector<int> remoteFiles = manifest.sortedIndexes();
     
-    if(!checkFiles())
+    // both lists are sorted by utf8 path, so a single merge pass pairs them
+    auto local = localFiles.cbegin();
+    auto remote = remoteFiles.cbegin();
+    while((local != localFiles.cend() || remote != remoteFiles.cend()) && !(canceled && *canceled))
     {
-        missingFiles.insert(missingFiles.begin(), _missingDataFiles.begin(), _missingDataFiles.end());
-        missingFiles.insert(missingFiles.begin(), _missingExeFiles .begin(), _missingExeFiles .end());
+        int cmp = local  == localFiles.cend()  ?  1
+                : remote == remoteFiles.cend() ? -1
+                : -manifest.comparePath(*remote, local->first);
+        if(cmp < 0)
+            reconciliation.extra << QString::fromUtf8((local++)->first);
+        else if(cmp > 0)
+        {
+            reconciliation.added.push_back(*remote);
+            if(onMissing)
+                onMissing(*remote);
+            ++remote;
+        }
+        else
+        {
+            int i = *remote++;
+            if(local++->second == manifest.fileSize(i) && manifest.checkFile(i, appDir + manifest.path(i)))
+                reconciliation.unchanged.push_back(i);
+            else
+            {
+                reconciliation.changed.push_back(i);
+                if(onMissing)
+                    onMissing(i);
+            }
+        }
     }
+    return reconciliation;
+}
+
+VersionUpdater::Reconciliation VersionUpdater::verifyFiles(const Manifest& manifest, const std::vector<int>& filesToCheck, const QSet<QString>& removedFiles,
+                                                          bool checkDiffedOnly, const std::function<void(int)>& onMissing, const std::atomic<bool>* canceled)
+{
+    if(!checkDiffedOnly)
+        return reconcile(manifest, onMissing, canceled);
     
-    return missingFiles;
+    // files untouched by the diffs are unchanged since the installed version
+    Reconciliation reconciliation;
+    QString appDir = qApp->applicationDirPath() + '/';
+    for(int i : filesToCheck)
+    {
+        if(canceled && *canceled)
+            break;
+        if(manifest.checkFile(i, appDir + manifest.path(i)))
+            reconciliation.unchanged.push_back(i);
+        else
+        {
+            reconciliation.changed.push_back(i);
+            if(onMissing)
+                onMissing(i);
+        }
+    }
+    for(QString file : removedFiles)
+        if(manifest.indexOf(file) < 0 && QFileInfo::exists(appDir + file))
+            reconciliation.extra << file;
+    return reconciliation;
+}
+
+void VersionUpdater::storeVerification(const Reconciliation& reconciliation, bool dirtyOnly)
+{
+    // the files changed on disk during the verification stay dirty
+    QSet<int> changedFiles = _snapshot->takeChangedFiles();
+    auto store = [&](int i, VerificationSnapshot::State state){
+        if(!changedFiles.contains(i))
+            _snapshot->setState(i, state);
+    };
+    if(!dirtyOnly)
+    {
+        // files left out of a diffed only verification are valid too
+        for(int i : _snapshot->dirtyFiles().values()) // copied, states are changed in the loop
+            store(i, VerificationSnapshot::Valid);
+    }
+    for(int i : reconciliation.unchanged)
+        store(i, VerificationSnapshot::Valid);
+    for(int i : reconciliation.added)
+        store(i, VerificationSnapshot::Invalid);
+    for(int i : reconciliation.changed)
+        store(i, VerificationSnapshot::Invalid);
+    updateMissingFiles();
+    if(dirtyOnly)
+        return; // the stale files were listed by the previous verification
+    
+    _staleFiles.clear();
+    for(QString file : reconciliation.extra)
+        if(isStaleFile(file))
+            _staleFiles << file;
+}
+
+bool VersionUpdater::isStaleFile(const QString& path) const
+{
+    return _staleFilesPolicy != KeepStaleFiles && _remoteManifest.indexOf(path) < 0
+        && matchRegexpList(path, _staleFilesWhitelist) && !matchRegexpList(path, _staleFilesBlacklist) && !isSkippedComponentFile(path);
+}
+
+void VersionUpdater::refreshStaleFiles()
+{
+    // the list can be older than the online version, or than the app folder
+    QString appDir = qApp->applicationDirPath() + '/';
+    QStringList staleFiles;
+    for(QString file : _staleFiles)
+        if(isStaleFile(file) && QFileInfo::exists(appDir + file))
+            staleFiles << file;
+    _staleFiles = staleFiles;
+}
+
+void VersionUpdater::checkDirtyFiles()
+{
+    QString appDir = qApp->applicationDirPath() + '/';
+    for(int i : _snapshot->dirtyFiles().values()) // copied, states are changed in the loop
+        _snapshot->setState(i, _remoteManifest.checkFile(i, appDir + _remoteManifest.path(i)) ? VerificationSnapshot::Valid
+                                                                                              : VerificationSnapshot::Invalid);
+    updateMissingFiles();
+}
+
+void VersionUpdater::updateMissingFiles()
+{
+    _missingFiles.clear();
+    _lazyFiles.clear();
+    for(int i : _snapshot->invalidFiles())
+    {
+        if(isCoreFile(i))
+            _missingFiles.push_back(i);
+        else
+            _lazyFiles.insert(i);
+    }
+    std::sort(_missingFiles.begin(), _missingFiles.end());
+}
+
+void VersionUpdater::saveInstalledVersion()
+{
+    // saving the version json for the next diff based update
+    if(!_remoteVersionSaved)
+    {
+        _remoteVersionSaved = writeInstalledVersion(_remoteManifest);
+        if(_remoteVersionSaved)
+            saveCache();
+    }
+}
+
+void VersionUpdater::saveCache()
+{
+    // the size and modification time of the valid files, the next check only hashes the files that don't match them anymore
+    QString appDir = qApp->applicationDirPath() + '/';
+    QVariantMap record;
+    for(int i=0; i<_remoteManifest.count(); ++i)
+    {
+        if(_snapshot->state(i) != VerificationSnapshot::Valid)
+            continue;
+        QFileInfo info(appDir + _remoteManifest.path(i));
+        record[_remoteManifest.path(i)] = QVariantList{info.size(), info.lastModified().toMSecsSinceEpoch()};
+    }
+    // only the manifests leading to the saved version can tell that it is still the online one
+    QVariantMap files;
+    for(auto it = _manifestValidators.cbegin(); it != _manifestValidators.cend(); ++it)
+        if(it.value().toMap()["version"].toString() == _remoteManifest.version())
+            files[it.key()] = it.value();
+    
+    _cache = QVariantMap{{"version", _remoteManifest.version()}, {"versionDigest", _onlineDigest}, {"components", componentSelection()},
+                          {"files", files}};
+    QVariantMap saved = _cache;
+    saved["record"] = record; // only read back by the next check
+    QSaveFile cache(appDir + cacheFile);
+    if(cache.open(QFile::WriteOnly))
+    {
+        cache.write(QJsonDocument::fromVariant(saved).toJson(QJsonDocument::Compact));
+        cache.commit();
+    }
+}
+
+CacheValidators VersionUpdater::cachedValidators(const QString& filename) const
+{
+    QVariantMap entry = _cache["files"].toMap()[filename].toMap();
+    return {entry["etag"].toString().toLatin1(), entry["lastModified"].toString().toLatin1()};
+}
+
+bool VersionUpdater::isCachedManifest(const QString& filename, const QByteArray& data) const
+{
+    QVariantMap entry = _cache["files"].toMap()[filename].toMap();
+    return !entry.isEmpty() && QByteArray::fromBase64(entry["digest"].toString().toLatin1()) == QCryptographicHash::hash(data, QCryptographicHash::Sha1);
+}
+
+void VersionUpdater::rememberManifest(const QString& filename, const QByteArray& data, const QString& version)
+{
+    CacheValidators validators = _client->validators(filename);
+    _manifestValidators[filename] = QVariantMap{{"etag", QString::fromLatin1(validators.etag)},
+                                                {"lastModified", QString::fromLatin1(validators.lastModified)},
+                                                {"digest", QString::fromLatin1(QCryptographicHash::hash(data, QCryptographicHash::Sha1).toBase64())},
+                                                {"version", version}};
+}
+
+QString VersionUpdater::componentSelection() const
+{
+    if(_allComponents)
+        return "*";
+    QStringList names = _installedComponents.values();
+    names.sort();
+    return names.join(',');
 }
 
 bool VersionUpdater::restartRequired()
 {
-    checkFiles();
-    return !_missingExeFiles.empty();
+    for(int i : missingFiles())
+        if(_remoteManifest.kind(i) == Manifest::Exe)
+            return true;
+    return false;
 }
 
 const std::unordered_map<QString, std::pair<qint64,qint64>>& VersionUpdater::getDetailedProgress()
@@ -261,32 +1122,489 @@ const std::unordered_map<QString, std::pair<qint64,qint64>>& VersionUpdater::get
 
 std::pair<qint64,qint64> VersionUpdater::getTotalProgress()
 {
+    if(_lock->isFollowing())
+        return _lock->sharedProgress();
     return _client->getTotalProgress();
 }
 
 void VersionUpdater::downloadFiles()
 {
-    checkFiles();
-    for(auto it : _missingDataFiles)
-        _client->getFile(it.first, tmpData);
-    for(auto it : _missingExeFiles)
-        _client->getFile(it.first, tmpExe);
+    startDownloads();
+    for(int i : missingFiles())
+        downloadFile(i);
+    _client->endBatch(); // emits allFilesReceived once the downloads, and the full files replacing failed patches, are over
+}
+
+void VersionUpdater::startDownloads()
+{
+    _client->beginBatch();
+    _pendingPatches.clear();
+    QDir(qApp->applicationDirPath() + '/' + tmpPatch).removeRecursively(); // leftovers of a canceled batch
+}
+
+void VersionUpdater::downloadFile(int i)
+{
+    QString filename = _remoteManifest.path(i);
+    QString dstDir = downloadDir(i);
+    
+    // a patch from the local version of the file is downloaded instead of the whole file
+    QList<Manifest::Patch> patches = _remoteManifest.patches(filename);
+    if(!patches.isEmpty())
+    {
+        QByteArray localHash;
+        quint64 localSize;
+        computeHash(qApp->applicationDirPath() + '/' + filename, localHash, localSize);
+        for(const Manifest::Patch& patch : patches)
+            if(patch.source == localHash && !_pendingPatches.contains(patch.file))
+            {
+                _pendingPatches[patch.file] = i;
+                _client->getOptionalFile(patch.file, tmpPatch, QByteArray(), patch.size);
+                return;
+            }
+    }
+    _client->getFile(filename, dstDir, _remoteManifest.digest(i), _remoteManifest.fileSize(i));
+}
+
+QString VersionUpdater::downloadDir(int i) const
+{
+    return _stagingPrefix + (_remoteManifest.kind(i) == Manifest::Exe ? tmpExe : tmpData);
+}
+
+void VersionUpdater::handlePatch(QString filename, bool received)
+{
+    auto pending = _pendingPatches.find(filename);
+    if(pending == _pendingPatches.end())
+        return; // not requested by the current batch
+    int i = pending.value();
+    _pendingPatches.erase(pending);
+    
+    // the patched file is verified like a downloaded file before taking its place in the tmp folder
+    QString appDir = qApp->applicationDirPath() + '/';
+    QString patchPath = appDir + tmpPatch + '/' + filename;
+    QString target = appDir + downloadDir(i) + '/' + _remoteManifest.path(i);
+    QFile sourceFile(appDir + _remoteManifest.path(i));
+    QFile patchFile(patchPath);
+    QByteArray result;
+    bool ok = received && sourceFile.open(QFile::ReadOnly) && patchFile.open(QFile::ReadOnly)
+           && BinaryPatch::apply(sourceFile.readAll(), patchFile.readAll(), result)
+           && result.size() == _remoteManifest.fileSize(i)
+           && _remoteManifest.digestEquals(i, QCryptographicHash::hash(result, QCryptographicHash::Sha1));
+    patchFile.close();
+    QFile::remove(patchPath);
+    if(ok)
+    {
+        QFile targetFile(target);
+        ok = QDir(appDir).mkpath(QFileInfo(target).path()) && targetFile.open(QFile::WriteOnly)
+          && targetFile.write(result) == result.size();
+    }
+    
+    // still part of the batch, the patch download only ends once the full file is requested
+    if(!ok)
+        _client->getFile(_remoteManifest.path(i), downloadDir(i), _remoteManifest.digest(i), _remoteManifest.fileSize(i));
+}
+
+void VersionUpdater::checkAndDownloadFiles()
+{
+    assert(_currentStep > 1); // try waiting for the onlineVersionReceived signal before calling this method
+    if(_verifier && _verifier->isRunning())
+    {
+        if(!_canceled)
+            return; // already running for this online version
+        _verifier->wait(); // canceled, it stops at the next file
+    }
+    
+    _missingFiles.clear();
+    startDownloads();
+    
+    // once verified, only the files changed since are verified again, the known invalid files are downloaded right away
+    if(_snapshot->needsRefresh())
+        _snapshot->refresh();
+    _snapshot->takeChangedFiles(); // already dirty, they are verified now
+    bool dirtyOnly = !_snapshot->isUnknown();
+    std::vector<int> filesToCheck = _filesToCheck;
+    QSet<QString> removedFiles = _removedFiles;
+    if(dirtyOnly)
+    {
+        QList<int> dirtyFiles = _snapshot->dirtyFiles().values();
+        std::sort(dirtyFiles.begin(), dirtyFiles.end());
+        filesToCheck.assign(dirtyFiles.cbegin(), dirtyFiles.cend());
+        removedFiles.clear();
+        for(int i : _snapshot->invalidFiles())
+            if(isCoreFile(i))
+                downloadFile(i);
+    }
+    
+    Manifest manifest = _remoteManifest;
+    bool checkDiffedOnly = dirtyOnly || _checkDiffedOnly;
+    startVerifier([this, manifest, filesToCheck, removedFiles, checkDiffedOnly, dirtyOnly](int verification) -> std::function<void()> {
+        Reconciliation reconciliation = verifyFiles(manifest, filesToCheck, removedFiles, checkDiffedOnly, [this, verification](int i){
+            // queued to the updater thread, the download starts while the verification goes on
+            QMetaObject::invokeMethod(this, [this, verification, i](){
+                if(verification == _verification && isCoreFile(i))
+                    downloadFile(i);
+            }, Qt::QueuedConnection);
+        }, &_canceled);
+        return [this, reconciliation, dirtyOnly](){ handleVerified(reconciliation, dirtyOnly); };
+    });
+}
+
+void VersionUpdater::startVerifier(const std::function<std::function<void()>(int verification)>& work)
+{
+    // the thread works on copies, the updater may load a new online version or be canceled meanwhile,
+    // the handler returned by the work is then dropped instead of being called in the updater thread
+    _canceled = false;
+    int verification = ++_verification;
+    _verifier = QThread::create([this, verification, work](){
+        std::function<void()> handler = work(verification);
+        QMetaObject::invokeMethod(this, [this, verification, handler](){
+            if(verification == _verification)
+                handler();
+        }, Qt::QueuedConnection);
+    });
+    connect(_verifier, &QThread::finished, _verifier, &QObject::deleteLater);
+    _verifier->start();
+}
+
+void VersionUpdater::handleVerified(const Reconciliation& reconciliation, bool dirtyOnly)
+{
+    storeVerification(reconciliation, dirtyOnly);
+    bool filesOk = _missingFiles.empty();
+    if(filesOk && _lazyFiles.isEmpty())
+        saveInstalledVersion();
+    if(filesOk && _staging)
+    {
+        _staging = false; // the app files already match, nothing to stage
+        _stagingPrefix.clear();
+    }
+    if(filesOk)
+        releaseLock("upToDate");
+    emit filesChecked(filesOk);
+    _client->endBatch();
+}
+
+void VersionUpdater::cancelUpdate()
+{
+    stopVerifier(); // so that the update can be restarted right away
+    _staging = false;
+    _stagingPrefix.clear();
+    _pendingPatches.clear();
+    _client->abortDownloads();
+    _lock->stopFollowing();
+    releaseLock("canceled");
+}
+
+void VersionUpdater::stopVerifier()
+{
+    // the thread checks the flag between files, its queued results are then dropped
+    _canceled = true;
+    ++_verification;
+    if(_verifier)
+        _verifier->wait();
+}
+
+void VersionUpdater::setRetryPolicy(int maxAttempts, int baseDelayMs, int maxDelayMs)
+{
+    _client->setRetryPolicy(maxAttempts, baseDelayMs, maxDelayMs);
+}
+
+void VersionUpdater::setConcurrency(int initialLimit, int minLimit, int maxLimit)
+{
+    _client->setConcurrency(initialLimit, minLimit, maxLimit);
 }
 
 void VersionUpdater::handleFinished()
 {
+    if(_staging)
+    {
+        verifyStagedFiles();
+        return;
+    }
     _currentStep = 3;
+    writeStatus("downloaded");
     emit allFilesDownloaded();
 }
 
+void VersionUpdater::startBackgroundUpdates(int intervalMs)
+{
+    if(!_pollTimer)
+    {
+        _pollTimer = new QTimer(this);
+        connect(_pollTimer, &QTimer::timeout, this, &VersionUpdater::poll);
+    }
+    _pollTimer->start(intervalMs);
+    poll();
+}
+
+void VersionUpdater::stopBackgroundUpdates()
+{
+    if(_pollTimer)
+        _pollTimer->stop();
+    if(_staging)
+        cancelUpdate();
+}
+
+void VersionUpdater::poll()
+{
+    if(_staging || _verifier)
+        return; // still busy with the previous poll
+    _staging = true;
+    getOnlineVersionInfo();
+}
+
+void VersionUpdater::stageOnlineVersion()
+{
+    QString version = _remoteManifest.version();
+    if(version == qApp->applicationVersion() || version == stagedVersion())
+    {
+        _staging = false; // nothing new
+        releaseLock("upToDate");
+        return;
+    }
+    
+    // a single version is staged at a time
+    QDir(qApp->applicationDirPath() + '/' + stagingDir).removeRecursively();
+    _stagingPrefix = stagingDir + '/' + version + '/';
+    checkAndDownloadFiles();
+}
+
+void VersionUpdater::verifyStagedFiles()
+{
+    // the staged files are checked once more as a whole, they can wait on disk for a long time before being applied
+    if(_verifier)
+        _verifier->wait(); // the thread that checked the app files is finishing, it queued its results already
+    
+    Manifest manifest = _remoteManifest;
+    std::vector<std::pair<QString,int>> files;
+    for(int i : _missingFiles)
+        files.push_back({qApp->applicationDirPath() + '/' + downloadDir(i) + '/' + _remoteManifest.path(i), i});
+    startVerifier([this, manifest, files](int) -> std::function<void()> {
+        bool ok = true;
+        for(size_t k=0; k<files.size() && ok && !_canceled; ++k)
+            ok = manifest.checkFile(files[k].second, files[k].first);
+        return [this, ok](){ handleStaged(ok); };
+    });
+}
+
+void VersionUpdater::handleStaged(bool ok)
+{
+    if(!_staging)
+        return;
+    QString version = _remoteManifest.version();
+    QString folder = qApp->applicationDirPath() + '/' + _stagingPrefix;
+    
+    // the ready marker is the online version json, with the list of staged files, their size and modification time
+    // once verified (so that applying doesn't need to hash them again), and the stale files to remove along
+    QVariantMap ready = parseJsonMap(_remoteManifest.toJson());
+    QStringList stagedFiles;
+    QVariantMap stagedStats;
+    qint64 stagedBytes = 0;
+    bool restart = false;
+    for(int i : _missingFiles)
+    {
+        QFileInfo info(qApp->applicationDirPath() + '/' + downloadDir(i) + '/' + _remoteManifest.path(i));
+        stagedFiles << _remoteManifest.path(i);
+        stagedStats[_remoteManifest.path(i)] = QVariantList{info.size(), info.lastModified().toMSecsSinceEpoch()};
+        stagedBytes += _remoteManifest.fileSize(i);
+        restart = restart || _remoteManifest.kind(i) == Manifest::Exe;
+    }
+    refreshStaleFiles();
+    ready["stagedFiles"] = stagedFiles;
+    ready["stagedStats"] = stagedStats;
+    ready["staleFiles"] = _staleFiles;
+    QByteArray json = QJsonDocument::fromVariant(ready).toJson();
+    QFile marker(folder + readyFile);
+    if(ok)
+        ok = marker.open(QFile::WriteOnly) && marker.write(json) == json.size();
+    
+    _staging = false;
+    _stagingPrefix.clear();
+    if(ok)
+    {
+        releaseLock("staged");
+        emit versionReady(version, stagedFiles.size(), stagedBytes, restart);
+    }
+    else
+    {
+        QDir(folder).removeRecursively();
+        emit failure({tr("Can't stage version : %1").arg(version)});
+    }
+}
+
+QString VersionUpdater::stagedVersion() const
+{
+    QDir dir(qApp->applicationDirPath() + '/' + stagingDir);
+    for(QString version : dir.entryList(QDir::Dirs | QDir::NoDotAndDotDot))
+        if(QFileInfo::exists(dir.filePath(version + '/' + readyFile)))
+            return version;
+    return QString();
+}
+
+bool VersionUpdater::applyStagedVersion()
+{
+    QString version = stagedVersion();
+    if(version.isEmpty() || !_lock->acquire())
+        return false; // nothing to do, or another instance is on it
+    QString appDir = qApp->applicationDirPath() + '/';
+    QString folder = stagingDir + '/' + version + '/';
+    
+    // the staged files may have been touched while waiting on disk, they must still have the size and modification time
+    // they had once verified, without hashing them again
+    Manifest staged;
+    QStringList dataFiles;
+    QStringList exeFiles;
+    QFile marker(appDir + folder + readyFile);
+    bool valid = marker.open(QFile::ReadOnly);
+    QByteArray json = valid ? marker.readAll() : QByteArray();
+    marker.close();
+    valid = valid && staged.fromJson(json) && staged.version() == version;
+    QVariantMap ready = parseJsonMap(json);
+    QVariantMap stagedStats = ready["stagedStats"].toMap();
+    for(QString file : ready["stagedFiles"].toStringList())
+    {
+        int i = valid ? staged.indexOf(file) : -1;
+        QString dir = i >= 0 && staged.kind(i) == Manifest::Exe ? tmpExe : tmpData;
+        QVariantList stat = stagedStats.value(file).toList();
+        QFileInfo info(appDir + folder + dir + '/' + file);
+        valid = i >= 0 && stat.size() == 2 && info.size() == staged.fileSize(i) && stat[0].toLongLong() == info.size()
+             && stat[1].toLongLong() == info.lastModified().toMSecsSinceEpoch();
+        if(dir == tmpExe)
+            exeFiles << file;
+        else
+            dataFiles << file;
+    }
+    if(!valid)
+    {
+        QDir(appDir + stagingDir).removeRecursively(); // staged again by the next poll
+        emit failure({tr("Staged version is corrupted : %1").arg(version)}); // releases the lock
+        return false;
+    }
+    
+    // the stale files listed when staging are removed along, unless the staged version has them now
+    QStringList staleFiles;
+    for(QString file : ready["staleFiles"].toStringList())
+        if(staged.indexOf(file) < 0 && QFileInfo::exists(appDir + file))
+            staleFiles << file;
+    
+    // the staged data files are moved in place, a rename per file
+    _rollback->keep(dataFiles, exeFiles + staleFiles);
+    _rollback->prune();
+    QStringList errors;
+    for(QString file : dataFiles)
+    {
+        QFile::remove(appDir + file);
+        if(!QDir(appDir).mkpath(QFileInfo(file).path()) || !QFile::rename(appDir + folder + tmpData + '/' + file, appDir + file))
+            errors << tr("Can't move staged file : %1").arg(appDir + file);
+    }
+    if(!errors.isEmpty())
+    {
+        emit failure(errors); // releases the lock
+        return false;
+    }
+    
+    // the exe files are copied by the update script once the app has quit
+    QFile::remove(appDir + folder + readyFile);
+    QDir(appDir + folder + tmpData).removeRecursively();
+    _staleFiles = staleFiles;
+    if(!removeStaleFiles())
+        return false; // reported, the staged exe files are staged again by the next poll
+    bool ok = exeFiles.isEmpty() || startUpdateScript(folder + tmpExe, _rollback->maxVersions() > 0 ? exeFiles : QStringList());
+    if(!ok)
+        return false;
+    
+    // the staged version is the installed one now, the cache describes the previous one
+    writeInstalledVersion(staged);
+    QFile::remove(appDir + cacheFile);
+    _cache.clear();
+    if(exeFiles.isEmpty())
+    {
+        QDir(appDir + stagingDir).removeRecursively();
+        releaseLock("updated");
+    }
+    else
+        restartWithUpdateScript();
+    return true;
+}
+
+void VersionUpdater::setRollbackVersions(int versions)
+{
+    _rollback->setMaxVersions(versions);
+}
+
+QStringList VersionUpdater::rollbackVersions() const
+{
+    return _rollback->versions();
+}
+
+bool VersionUpdater::rollback(QString version)
+{
+    Manifest manifest;
+    if(!_rollback->readManifest(version, manifest))
+        return false; // not a failure of the update that may be running, which "failure" would end
+    if((_verifier && _verifier->isRunning()) || _lock->isLocked())
+        return false; // an update of this instance is running
+    if(!_lock->acquire())
+        return false; // another instance is on it
+    
+    // the files recorded at the last check of the installed version are trusted, like "getOnlineVersionInfo" does
+    QString appDir = qApp->applicationDirPath() + '/';
+    Manifest installed;
+    QFile installedFile(appDir + installedVersionFile);
+    if(!installedFile.open(QFile::ReadOnly) || !installed.fromJson(installedFile.readAll()))
+        installed.clear();
+    QFile cache(appDir + cacheFile);
+    QVariantMap cacheMap = cache.open(QFile::ReadOnly) ? parseJsonMap(cache.readAll()) : QVariantMap();
+    QVariantMap record = cacheMap["version"].toString() == installed.version() ? cacheMap["record"].toMap() : QVariantMap();
+    
+    // the kept copies are hashed in the verifier thread
+    QStringList candidates = _rollback->versions();
+    candidates.removeAll(version);
+    candidates.prepend(version);
+    startVerifier([this, version, manifest, installed, record, candidates](int) -> std::function<void()> {
+        QStringList errors;
+        QMap<QString, QString> sources = _rollback->resolveSources(manifest, installed, record, candidates, errors, &_canceled);
+        return [this, version, manifest, installed, sources, errors](){ finishRollback(version, manifest, installed, sources, errors); };
+    });
+    return true;
+}
+
+void VersionUpdater::finishRollback(const QString& version, const Manifest& manifest, const Manifest& installed,
+                                    const QMap<QString, QString>& sources, QStringList errors)
+{
+    QStringList restoredExe;
+    if(errors.isEmpty())
+        _rollback->restore(version, manifest, installed, sources, tmpExe, restoredExe, errors);
+    if(!errors.isEmpty())
+    {
+        emit failure(errors); // releases the lock
+        return;
+    }
+    
+    // the restored version is now the installed one, the next check records its files again
+    writeInstalledVersion(manifest);
+    QFile::remove(qApp->applicationDirPath() + '/' + cacheFile);
+    _cache.clear();
+    _rollback->remove(version);
+    _rollback->prune();
+    
+    if(restoredExe.isEmpty())
+        releaseLock("rolledBack");
+    else if(startUpdateScript(tmpExe, restoredExe))
+        restartWithUpdateScript();
+    else
+        return; // reported by startUpdateScript
+    emit rolledBack(version, !restoredExe.isEmpty());
+}
+
 bool VersionUpdater::applyDataPatch()
 {
     QString source = qApp->applicationDirPath() + '/' + tmpData + '/';
     QString target = qApp->applicationDirPath() + '/';
     
-    for(auto it : _missingDataFiles)
+    for(int i : _missingFiles)
     {
-        const QString& filename = it.first;
+        if(_remoteManifest.kind(i) != Manifest::Data)
+            continue;
+        QString filename = _remoteManifest.path(i);
         if(!QFileInfo::exists(source + filename))
         {
             emit failure({tr("Source file doesn't exist : %1").arg(source + filename)});
@@ -311,6 +1629,15 @@ bool VersionUpdater::applyDataPatch()
             return false;
         }*/
     }
+    // the replaced files are kept for rollback, the stale ones are removed by removeStaleFiles
+    refreshStaleFiles();
+    QStringList replacedFiles;
+    for(int i : _missingFiles)
+        if(_remoteManifest.kind(i) == Manifest::Data)
+            replacedFiles << _remoteManifest.path(i);
+    _rollback->keep(replacedFiles, _staleFiles);
+    _rollback->prune();
+    
     // workaround because QFile::copy fails to copy but returns true...
     QProcess process;
     process.setWorkingDirectory(qApp->applicationDirPath());
@@ -327,7 +1654,122 @@ bool VersionUpdater::applyDataPatch()
     if(tmpDir.exists())
         tmpDir.removeRecursively();
     
-    return true;
+    bool ok = removeStaleFiles();
+    bool restart = std::any_of(_missingFiles.cbegin(), _missingFiles.cend(), [this](int i){ return _remoteManifest.kind(i) == Manifest::Exe; });
+    if(ok && !restart)
+    {
+        if(_lazyFiles.isEmpty())
+            saveInstalledVersion(); // the next check starts from the applied version
+        releaseLock("updated"); // otherwise held until the update script is started
+    }
+    return ok;
+}
+
+void VersionUpdater::setCoreFiles(QStringList whitelist)
+{
+    _coreFiles = whitelist;
+}
+
+bool VersionUpdater::isCoreFile(int i) const
+{
+    return _coreFiles.isEmpty() || _remoteManifest.kind(i) == Manifest::Exe || matchRegexpList(_remoteManifest.path(i), _coreFiles);
+}
+
+bool VersionUpdater::ensureFile(QString path)
+{
+    int i = _remoteManifest.indexOf(path);
+    if(i >= 0 && _lazyFiles.contains(i))
+    {
+        fetchLazyFile(i);
+        return false;
+    }
+    return QFileInfo::exists(qApp->applicationDirPath() + '/' + path);
+}
+
+void VersionUpdater::startPrefetch(int maxParallelDownloads)
+{
+    _prefetchSlots = maxParallelDownloads;
+    prefetchNext();
+}
+
+void VersionUpdater::prefetchNext()
+{
+    for(auto it = _lazyFiles.cbegin(); it != _lazyFiles.cend() && _fetchingFiles.size() < _prefetchSlots; ++it)
+        if(!_fetchingFiles.contains(*it) && !_unavailableFiles.contains(*it))
+            fetchLazyFile(*it);
+}
+
+void VersionUpdater::fetchLazyFile(int i)
+{
+    if(_fetchingFiles.contains(i))
+        return;
+    _fetchingFiles.insert(i);
+    _client->getLazyFile(_remoteManifest.path(i), tmpLazy);
+}
+
+void VersionUpdater::handleLazyFile(QString filename, bool received)
+{
+    QString appDir = qApp->applicationDirPath() + '/';
+    QString source = appDir + tmpLazy + '/' + filename;
+    int i = _remoteManifest.indexOf(filename);
+    if(i < 0 || !_fetchingFiles.remove(i))
+        return; // not requested for the current online version
+    
+    // verified before being moved in place, so a partial file is never used
+    bool ok = received && _remoteManifest.checkFile(i, source);
+    if(ok)
+    {
+        QFile::remove(appDir + filename);
+        ok = QDir(appDir).mkpath(QFileInfo(filename).path()) && QFile::rename(source, appDir + filename);
+    }
+    QFile::remove(source);
+    
+    if(ok)
+    {
+        _snapshot->setState(i, VerificationSnapshot::Valid);
+        _lazyFiles.remove(i);
+        _unavailableFiles.remove(i);
+        if(_lazyFiles.isEmpty() && _missingFiles.empty())
+            saveInstalledVersion();
+        emit fileAvailable(filename);
+    }
+    else
+    {
+        _unavailableFiles.insert(i);
+        emit fileUnavailable(filename);
+    }
+    prefetchNext();
+}
+
+void VersionUpdater::setStaleFilesPolicy(StaleFilesPolicy policy, QStringList whitelist, QStringList blacklist)
+{
+    _staleFilesPolicy = policy;
+    _staleFilesWhitelist = whitelist;
+    _staleFilesBlacklist = blacklist;
+}
+
+bool VersionUpdater::removeStaleFiles()
+{
+    QString appDir = qApp->applicationDirPath() + '/';
+    QStringList errors;
+    refreshStaleFiles();
+    for(QString file : _staleFiles)
+    {
+        if(_staleFilesPolicy == QuarantineStaleFiles)
+        {
+            QString target = appDir + quarantineDir + '/' + file;
+            QFile::remove(target); // older quarantined copy
+            if(!QDir(appDir).mkpath(QFileInfo(target).path()) || !QFile::rename(appDir + file, target))
+                errors << tr("Can't move file to quarantine : %1").arg(appDir + file);
+        }
+        else if(!QFile::remove(appDir + file))
+            errors << tr("Can't remove file : %1").arg(appDir + file);
+    }
+    _staleFiles.clear();
+    
+    if(!errors.isEmpty())
+        emit failure(errors);
+    return errors.isEmpty();
 }
 
 bool VersionUpdater::applyExePatchAndRestart()
@@ -336,33 +1778,54 @@ bool VersionUpdater::applyExePatchAndRestart()
     if(restartRequired())
     {
         QString source = qApp->applicationDirPath() + '/' + tmpExe + '/';
-        for(auto it : _missingExeFiles) // check if files have been successfully downloaded
+        QStringList exeFiles;
+        for(int i : _missingFiles) // check if files have been successfully downloaded
         {
-            const QString& filename = it.first;
+            if(_remoteManifest.kind(i) != Manifest::Exe)
+                continue;
+            QString filename = _remoteManifest.path(i);
             if(!QFileInfo::exists(source + filename))
             {
                 emit failure({tr("Source file doesn't exist : %1").arg(source + filename)});
                 return false;
             }
+            exeFiles << filename;
         }
         
-        QFile batFile(qApp->applicationDirPath() + '/' + "updater.bat");
-        if(!batFile.open(QFile::WriteOnly | QFile::Text))
-        {
-            emit failure({tr("cannot write update script : %1").arg(qApp->applicationDirPath() + '/' + "updater.bat")});
-            return false;
-        }
-        QString text = 
-              QString(":copyit")                  + "\n"
-            + "timeout /t 1"                      + "\n"  // wait 1 second
-            + "xcopy " + tmpExe + " . /Y /E /I"   + "\n"  // try copying tmp folder into app folder
-            + "IF %errorlevel% NEQ 0 GOTO copyit" + "\n"  // if copying failed try again
-            + "rmdir " + tmpExe + " /S /Q"        + "\n"  // delete tmpExe dir
-            + "start " + qApp->arguments().at(0)  + "\n"  // start the application
-            + "DEL \"%~f0\" & EXIT"               + "\n"; // self destruct the batch file
-        batFile.write(text.toUtf8());
-        batFile.close();
-        return QProcess::startDetached(QString("cmd /c updater.bat"));
+        _rollback->keep(QStringList(), exeFiles);
+        _rollback->prune();
+        bool ok = startUpdateScript(tmpExe, _rollback->maxVersions() > 0 ? exeFiles : QStringList());
+        if(ok && _lazyFiles.isEmpty())
+            saveInstalledVersion(); // the script copies the exe files until it succeeds
+        if(ok)
+            restartWithUpdateScript();
+        return ok;
     }
     return false; // nothing to do
 }
+
+bool VersionUpdater::startUpdateScript(QString exeDir, QStringList replacedFiles)
+{
+    QFile batFile(qApp->applicationDirPath() + '/' + updateScriptFile);
+    if(!batFile.open(QFile::WriteOnly | QFile::Text))
+    {
+        emit failure({tr("cannot write update script : %1").arg(qApp->applicationDirPath() + '/' + updateScriptFile)});
+        return false;
+    }
+    exeDir = QDir::toNativeSeparators(exeDir);
+    QString removeReplaced; // unlinked first, so that the hard links kept for rollback are not overwritten
+    for(QString file : replacedFiles)
+        removeReplaced += "del /F /Q \"" + QDir::toNativeSeparators(file) + "\" 2>NUL" + "\n";
+    QString text = 
+          QString(":copyit")                  + "\n"
+        + "timeout /t 1"                      + "\n"  // wait 1 second
+        + removeReplaced
+        + "xcopy " + exeDir + " . /Y /E /I"   + "\n"  // try copying tmp folder into app folder
+        + "IF %errorlevel% NEQ 0 GOTO copyit" + "\n"  // if copying failed try again
+        + "rmdir " + exeDir + " /S /Q"        + "\n"  // delete tmp folder
+        + "start " + qApp->arguments().at(0)  + "\n"  // start the application
+        + "DEL \"%~f0\" & EXIT"               + "\n"; // self destruct the batch file, which ends the update for the other instances
+    batFile.write(text.toUtf8());
+    batFile.close();
+    return QProcess::startDetached("cmd /c " + updateScriptFile);
+}
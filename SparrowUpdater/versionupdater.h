@@ -2,8 +2,21 @@
 #define VERSIONUPDATER_H
 
 #include <QObject>
+#include <QSet>
+#include <QPointer>
+#include <QVariantMap>
+#include <atomic>
+#include <functional>
+
+#include "manifest.h"
 
 class UpdaterClient;
+class VerificationSnapshot;
+class QThread;
+class QTimer;
+class InstanceLock;
+class RollbackStore;
+struct CacheValidators;
 
 #ifndef QSTRING_HASH
 #define QSTRING_HASH
@@ -24,7 +37,7 @@ namespace std {
 /**
  * @brief The VersionUpdater class handles auto-updating based on file hashes and version numbers
  * 
- * limitations : currently, this updater is not capable of deleting files, only adding files or overriding them
+ * local files that are not part of the online version are kept, unless a stale files policy is set
  */
 class VersionUpdater : public QObject
 {
@@ -32,15 +45,18 @@ class VersionUpdater : public QObject
 public:
     /**
      * Constructor
-     * baseUrl is the http URL the updates will be pulled from
+     * baseUrl is the http URL the updates will be pulled from,
+     * or a local folder (file:// URL or path, like a mounted share or a usb drive), whose files are copied without a web server
      */
     VersionUpdater(QObject* parent = nullptr, QString baseUrl = "http://localhost/");
+    virtual ~VersionUpdater();
     
 signals:
     /**
      * signal received when the VersionUpdater encounters an error
      * it can contain:
-     * - network errors (mostly if the server can't be reached or a file is missing)
+     * - network errors (mostly if the server can't be reached or a file is missing),
+     *   file downloads are only reported once they all ended, after retrying the transient errors (see "setRetryPolicy")
      * - json parsing errors (if you version.json is crap, you can use "generateVersionJson")
      * - filesystem errors (mostly if your app doesn't have the rights to overwrite its own files)
      * 
@@ -55,9 +71,29 @@ public slots:
     /** 
      * first method to call, this requests latest version information from the server
      * listen the "onlineVersionReceived" signal to get the answer to this network request
+     * 
+     * if a version json has been installed before (see "checkFiles"), only the diffs between the installed version
+     * and the latest one are downloaded and applied to it, following the shortest chain listed in the diff index.
+     * files that are not touched by these diffs are then assumed to still match and are not checked again.
+     * the full version json is downloaded when no such chain exists on the server
+     *
+     * the diff index (or the version json) is only downloaded again if it changed since the installed version was saved.
+     * when it didn't, and the files recorded then still have the same size and modification time, the check ends there :
+     * the online version is the installed one and "checkFiles" has nothing to hash
+     *
+     * the sub-manifests of the installed components (see "setInstalledComponents") are then downloaded,
+     * except the ones unchanged since the installed version, the signal is only emitted once the online version contains their files
      */
     void getOnlineVersionInfo();
     
+public:
+    
+    /**
+     * the online version can be split in components (see "generateComponents"), by default every component is installed
+     * otherwise only the listed components are fetched, checked and updated, the local files of the other components are left alone
+     */
+    void setInstalledComponents(QStringList components);
+    
 signals:
     
     /**
@@ -72,7 +108,11 @@ public:
     
     /**
      * requires "getOnlineVersionInfo" to have succeeded
-     * returns true if all files are identical to the online version
+     * returns true if all files are identical to the online version,
+     * in this case the online version json is saved as the installed version for the next diff based update
+     * 
+     * the result is kept in a verification snapshot : files are watched and only the files modified since are checked again,
+     * so repeated calls are cheap. the snapshot survives new online versions for the files that didn't change
      */
     bool checkFiles();
     
@@ -82,6 +122,32 @@ public:
      */
     std::vector<std::pair<QString,qint64>> filesToUpdate();
     
+    /**
+     * requires "getOnlineVersionInfo" to have succeeded
+     * compact online version information, and the indexes of its files that are different from the local ones
+     */
+    const Manifest& onlineManifest() const { return _remoteManifest; }
+    const std::vector<int>& missingFiles();
+    
+    /**
+     * result of the reconciliation of the app folder with the online version
+     * online files are manifest indexes, local files are paths relative to the app folder
+     */
+    struct Reconciliation
+    {
+        std::vector<int> added;     // online files missing locally
+        std::vector<int> changed;   // online files that are different locally
+        std::vector<int> unchanged;
+        QStringList      extra;     // local files that are not in the online version
+    };
+    
+    /**
+     * requires "getOnlineVersionInfo" to have succeeded
+     * compares the app folder with the online version in a single merge of both sorted file lists,
+     * local files are only hashed when their size matches the online one
+     */
+    Reconciliation reconcileFiles();
+    
     /**
      * requires "getOnlineVersionInfo" to have succeeded
      * returns true if a restart will be required for the update to complete (exe or dll files are in the update)
@@ -101,12 +167,57 @@ public slots:
      * requires "getOnlineVersionInfo" to have succeeded
      * downloads the files that are different from the online version
      * data files will go to the tmpData folder, exe files will go to tmpExe folder
+     * when the online version lists a binary patch from the local version of a file (see "generatePatches"),
+     * the patch is downloaded instead (like the other files, with retries) and applied in that folder,
+     * falling back to the full file if it can't be downloaded or the result doesn't match
      * listen to the "allFilesDownloaded" signal and the "progressChanged" signal to get the answer of thie request
      */
     void downloadFiles();
     
+    /**
+     * requires "getOnlineVersionInfo" to have succeeded
+     * pipelined alternative to "checkFiles" followed by "downloadFiles" : files are verified in a background thread,
+     * and every file found different from the online version is downloaded right away.
+     * once the files were verified, only the files changed since are verified again
+     * listen to the "filesChecked" signal to know if an update is needed, then to the "allFilesDownloaded" signal as usual.
+     * the other step 2 methods must not be called before "filesChecked" is emitted
+     */
+    void checkAndDownloadFiles();
+    
+    /**
+     * stops the verification and the downloads started by "checkAndDownloadFiles" or "downloadFiles"
+     * the update can be restarted from "checkAndDownloadFiles" or "downloadFiles".
+     * call it too when the update is abandoned after step 1 (the user declined it...), so that the other instances
+     * of the app are no longer kept waiting. it also stops following the update of another instance
+     */
+    void cancelUpdate();
+    
+public:
+    
+    /**
+     * file downloads failing with a transient error (timeout, connection reset, 5xx http status, hash mismatch)
+     * are retried with an exponential backoff and jitter, up to maxAttempts (4 by default).
+     * other errors (404...) fail the file at once, without stopping the other downloads
+     */
+    void setRetryPolicy(int maxAttempts, int baseDelayMs = 500, int maxDelayMs = 30000);
+    
+    /**
+     * file downloads are limited to a number of parallel requests (4 at first by default), adjusted while downloading
+     * from the measured throughput and latency, between minLimit and maxLimit. see "UpdaterClient::setConcurrency"
+     */
+    void setConcurrency(int initialLimit = 4, int minLimit = 1, int maxLimit = 16);
+    
 signals:
     
+    /// emitted when the limit of parallel downloads changes, for diagnostics : reason is "increase", "plateau", "latency" or "errors"
+    void concurrencyChanged(int limit, qint64 throughput, int latencyMs, QString reason);
+    
+    
+    /**
+     * signal emitted by "checkAndDownloadFiles" when all files have been verified
+     * filesOk is true if all files are identical to the online version, in that case nothing is downloaded
+     */
+    void filesChecked(bool filesOk);
     /**
      * signal emitted when file downloading progress changed
      */
@@ -123,6 +234,7 @@ public:
     /**
      * requires "downloadFiles" to have succeeded
      * copies the contents of tmpData to the program folder and deletes that folder
+     * once no exe file is left to copy, the online version json is saved as the installed version
      * 
      * returns true on success
      */
@@ -133,12 +245,152 @@ public:
      * if the tmpExe folder exists, this will start a batch script that tries to copy files
      * from the tmpExe folder to the app folder every second until it succeeds, then starts the updated app,
      * it is your responsibility to quit the app as soon as you can so the update can complete.
+     * the other instances of the app see the update running until the script is done
      * 
      * returns true if the update script has been successfully launched
      * doesn't do anything and returns false if restartRequired() == false
      */
     bool applyExePatchAndRestart();
     
+    enum StaleFilesPolicy { KeepStaleFiles, RemoveStaleFiles, QuarantineStaleFiles };
+    
+    /**
+     * stale files are local files that are not part of the online version, by default they are kept
+     * with the other policies, "checkFiles" lists the stale files matching whitelist and not blacklist (these strings are QRegExp)
+     * and "applyDataPatch" removes them, or moves them to the quarantine folder (this also works for loaded dlls).
+     * the whitelist has no default : the app folder usually holds settings, logs or caches that must survive the updates,
+     * only list the folders and file types that your releases own
+     */
+    void setStaleFilesPolicy(StaleFilesPolicy policy, QStringList whitelist, QStringList blacklist = QStringList());
+    
+    /**
+     * requires "checkFiles" to have been called
+     * removes or quarantines the stale files according to the policy
+     * 
+     * returns true on success
+     */
+    bool removeStaleFiles();
+    
+    // ================  BACKGROUND UPDATES  ================
+    
+public:
+    
+    /**
+     * polls the server every intervalMs, and stages each new version while the app runs : the files that differ
+     * are downloaded and verified in the staging/<version> folder, then a ready marker is written and "versionReady" is emitted.
+     * failures are reported through "failure", the next poll starts over.
+     * the other steps must not be used while background updates run
+     */
+    void startBackgroundUpdates(int intervalMs = 3600000);
+    void stopBackgroundUpdates();
+    
+    /// version staged and ready to be applied, empty if none
+    QString stagedVersion() const;
+    
+    /**
+     * moves the staged data files in place, a rename per file, it doesn't need the network nor the online version
+     * so it can be called at the start of the app, before the data files are loaded.
+     * the staged files must still have the size and modification time they had once verified, a corrupted staged version is removed.
+     * the stale files found when staging are handled by the stale files policy (see "setStaleFilesPolicy").
+     * staged exe files are copied by an update script like "applyExePatchAndRestart" does, quit the app as soon as you can in that case.
+     * the staged version is then saved as the installed version
+     * 
+     * returns true on success, false on error or if no version is staged
+     */
+    bool applyStagedVersion();
+    
+signals:
+    
+    /// emitted once a version is staged, with the work left to "applyStagedVersion"
+    void versionReady(QString version, int filesToApply, qint64 bytesToApply, bool restartRequired);
+    
+    // ===================  ROLLBACK  =======================
+    
+public:
+    
+    /**
+     * keeps the files replaced or removed by "applyDataPatch", "applyExePatchAndRestart" and "applyStagedVersion"
+     * for the last "versions" installed versions, in the rollback folder of the app folder.
+     * replaced data files are moved there, exe and stale files are hard linked where the filesystem allows it (copied otherwise),
+     * so a kept version costs little more disk space than the files that changed.
+     * 0 (the default) disables it, the kept versions are then removed by the next apply
+     */
+    void setRollbackVersions(int versions);
+    
+    /// versions that "rollback" can restore, newest first
+    QStringList rollbackVersions() const;
+    
+    /**
+     * restores a kept version without network access, every file is taken from the kept versions or left as is if it already matches.
+     * the files taken from the kept versions are verified in a background thread, then gathered in a temporary folder,
+     * and only then swapped with the app files : nothing is changed if one of them can't be restored.
+     * the current version is kept in turn, so that it can be restored back.
+     * exe files are copied by an update script like "applyExePatchAndRestart" does, quit the app as soon as you can in that case
+     * 
+     * the restored version becomes the installed version : the next update check brings the online version back,
+     * unless the server publishes the restored version again
+     * 
+     * returns true if the rollback started, "rolledBack" or "failure" tells how it ended.
+     * returns false if the version isn't kept, or if an update is busy (in this instance or in another one)
+     */
+    bool rollback(QString version);
+    
+signals:
+    
+    /// emitted once "rollback" restored the version, quit the app as soon as you can if restartRequired
+    void rolledBack(QString version, bool restartRequired);
+    
+    /// emitted when the installed files can't be kept for rollback (no installed version json...), the update goes on without them
+    void rollbackUnavailable(QString reason);
+    
+    // ===============  MULTIPLE INSTANCES  =================
+    
+    /*
+     * a single instance of the app updates the app folder at a time : step 1 takes a lock on the folder,
+     * which is held until the app is up to date, updated, staged, or the update failed or was canceled.
+     * when an update script copies the exe files, the update goes on until the script is done : the lock is held
+     * until the app quits, then the other instances wait for the script to delete itself.
+     * the holder publishes its state and progress in the updaterStatus.json file of the app folder
+     */
+    
+signals:
+    
+    /**
+     * emitted by "getOnlineVersionInfo" instead of starting the update when another instance of the app holds the lock.
+     * its progress is followed through the status file : "progressChanged" is emitted and "getTotalProgress" reports it.
+     * "otherInstanceFinished" is emitted once it is done, after which the update can be started again from step 1 (it is usually up to date)
+     */
+    void otherInstanceUpdating();
+    void otherInstanceFinished(bool succeeded);
+    
+    // ==================  LAZY FILES  ======================
+    
+public:
+    
+    /**
+     * enables the lazy mode : only the exe files and the data files matching whitelist (these strings are QRegExp)
+     * are part of the update, the other data files that are different from the online version are known but not present,
+     * they are fetched on first use by "ensureFile", or in the background by the prefetcher.
+     * an empty whitelist disables the lazy mode
+     */
+    void setCoreFiles(QStringList whitelist);
+    
+    /**
+     * requires "checkFiles" to have been called
+     * returns true if the file is present and up to date,
+     * otherwise the file is downloaded, verified and moved in place, then "fileAvailable" or "fileUnavailable" is emitted
+     */
+    bool ensureFile(QString path);
+    
+    /// starts fetching every lazy file in the background, with at most maxParallelDownloads downloads at once
+    void startPrefetch(int maxParallelDownloads = 2);
+    
+signals:
+    
+    /// answers to "ensureFile" and to the prefetcher, path is relative to the app folder
+    void fileAvailable(QString path);
+    void fileUnavailable(QString path);
+    
     // ====================  UTILS   ========================
     
 public:
@@ -147,7 +399,7 @@ public:
      * @brief parseAppFolder recursively parses the application dir
      * @param whitelist accepted file paths (these strings are QRegExp)
      * @param blacklist ignored  file paths (these strings are QRegExp)
-     * @return a list of file paths, relative to the current application dir
+     * @return a list of file paths, relative to the current application dir, without the files of the updater itself
      */
     static QStringList parseAppFolder(QStringList whitelist = {".*"}, QStringList blacklist = QStringList());
     
@@ -155,23 +407,145 @@ public:
     static QByteArray generateVersionJson(QStringList dataFiles = parseAppFolder({".*"}, {".*\\.exe", ".*\\.dll"}),
                                           QStringList exeFiles  = parseAppFolder({".*\\.exe", ".*\\.dll"}));
     
+    /// serialization of the files added, changed and removed between two version jsons
+    static QByteArray generateVersionDiff(QByteArray oldVersionJson, QByteArray newVersionJson);
+    
+    /**
+     * serialization of the index listing the available diffs, latestVersion is the version of the current version json
+     * and latestDigest its sha1 : a version published again with other files is noticed even though no diff leads to it
+     */
+    static QByteArray generateDiffIndex(QString latestVersion, QByteArrayList versionDiffs, QByteArray latestDigest = QByteArray());
+    
+    /**
+     * @brief publishVersionJson writes versionJson to the publish folder (usually the root of the update server)
+     * if a previous version.json is found there, the diff from it is added to the diffs folder and the diff index is regenerated
+     * @return true on success
+     */
+    static bool publishVersionJson(QByteArray versionJson, QString publishDir = ".");
+    
+    /**
+     * @brief generatePatches builds binary patches (see BinaryPatch) from the files of previous releases to the current files
+     * @param versionJson current version json, its files are read from the application dir
+     * @param previousReleaseDirs folders containing previous releases of the app, usually the last few ones
+     * @param patchedFiles file paths to patch (these strings are QRegExp), patches are mostly worth it for exe and dll files
+     * @param publishDir the patches are written in its patches folder
+     * @return versionJson listing the patches of each file by source digest (to publish with "publishVersionJson"), or an empty array on error
+     */
+    static QByteArray generatePatches(QByteArray versionJson, QStringList previousReleaseDirs,
+                                      QStringList patchedFiles = {".*\\.exe", ".*\\.dll"}, QString publishDir = ".");
+    
+    /**
+     * @brief generateComponents moves the files of optional components (language packs, big assets...) out of the version json
+     * @param components the file paths of each component by name (these strings are QRegExp), a file goes to the first matching component
+     * @param publishDir the sub-manifest of each component is written in its components folder
+     * @return versionJson without the component files, listing the components (to publish with "publishVersionJson"), or an empty array on error
+     */
+    static QByteArray generateComponents(QByteArray versionJson, QMap<QString, QStringList> components, QString publishDir = ".");
+    
     
 private slots:
     void handleVersion(QByteArray versionJson);
+    void handleManifestFile(QString filename, QByteArray data);
+    void handleManifestUnavailable(QString filename);
+    void handleManifestUnchanged(QString filename);
     void handleFinished();
     
 private:
+    void loadManifest(Manifest&& manifest);
+    // static, so that threads work on their own copy of the manifest and file lists
+    static Reconciliation reconcile(const Manifest& manifest, const std::function<void(int)>& onMissing = nullptr, const std::atomic<bool>* canceled = nullptr);
+    static Reconciliation verifyFiles(const Manifest& manifest, const std::vector<int>& filesToCheck, const QSet<QString>& removedFiles, bool checkDiffedOnly,
+                                      const std::function<void(int)>& onMissing = nullptr, const std::atomic<bool>* canceled = nullptr);
+    /// runs work in the verifier thread, the handler it returns is then called in the updater thread unless the work became obsolete
+    void startVerifier(const std::function<std::function<void()>(int verification)>& work);
+    void stopVerifier();
+    void storeVerification(const Reconciliation& reconciliation, bool dirtyOnly = false);
+    bool isStaleFile(const QString& path) const;
+    void refreshStaleFiles();
+    void checkDirtyFiles();
+    void updateMissingFiles();
+    void saveInstalledVersion();
+    void saveCache();
+    CacheValidators cachedValidators(const QString& filename) const;
+    bool isCachedManifest(const QString& filename, const QByteArray& data) const;
+    void rememberManifest(const QString& filename, const QByteArray& data, const QString& version);
+    QString componentSelection() const;
+    void handleVerified(const Reconciliation& reconciliation, bool dirtyOnly);
+    bool isCoreFile(int i) const;
+    void fetchLazyFile(int i);
+    void handleLazyFile(QString filename, bool received);
+    void prefetchNext();
+    void getFullVersion();
+    void rememberInstalledComponents();
+    void loadComponents();
+    void handleComponent(QString filename, const QByteArray& data);
+    void finishOnlineVersion();
+    bool isInstalledComponent(const QString& name) const;
+    bool isSkippedComponentFile(const QString& path) const;
+    void indexComponents(const QMap<QString, Manifest::Component>& components);
+    QString fileComponent(const QString& path) const; // empty if the file is in no component
+    void startDownloads();
+    void downloadFile(int i);
+    void handlePatch(QString filename, bool received);
+    QString downloadDir(int i) const;
+    void poll();
+    void stageOnlineVersion();
+    void verifyStagedFiles();
+    void handleStaged(bool ok);
+    bool startUpdateScript(QString exeDir, QStringList replacedFiles = QStringList());
+    void finishRollback(const QString& version, const Manifest& manifest, const Manifest& installed,
+                        const QMap<QString, QString>& sources, QStringList errors);
+    void restartWithUpdateScript();
+    void releaseLock(const QString& state);
+    void writeStatus(const QString& state, bool throttled = false);
+    
     UpdaterClient* _client;
     int _currentStep;
     
-    QStringList                            _remoteDataFiles;
-    QByteArrayList                         _remoteDataHashes;
-    QList<int>                             _remoteDataFileSizes;
-    std::vector<std::pair<QString,qint64>> _missingDataFiles;
-    QStringList                            _remoteExeFiles;
-    QByteArrayList                         _remoteExeHashes;
-    QList<int>                             _remoteExeFileSizes;
-    std::vector<std::pair<QString,qint64>> _missingExeFiles;
+    Manifest         _remoteManifest;
+    bool             _remoteVersionSaved; // saved as installed version once all files are ok
+    Manifest         _diffedManifest;     // online version being built from the installed one, the diffs and the components
+    Manifest         _installedManifest;  // installed version with the diffs applied, while the components are fetched
+    QStringList      _pendingDiffs;
+    QSet<QString>    _diffedFiles;        // files added or changed by the applied diffs
+    QSet<QString>    _removedFiles;       // files removed by the applied diffs
+    std::vector<int> _filesToCheck;       // indexes of the diffed files, and of the files changed on disk since the last record
+    bool             _checkDiffedOnly;
+    std::vector<int> _missingFiles;
+    QSet<QString>    _installedComponents;
+    bool             _allComponents;
+    QHash<QString, QString> _pendingComponents; // sub-manifest file -> component name
+    QMap<QString, QByteArray> _installedComponentDigests; // of the components installed along with the installed version
+    QMap<QString, QStringList> _componentPaths; // of the current components, see fileComponent
+    mutable QHash<QString, QString> _fileComponents; // path -> component name, each component file is matched once per set of components
+    QVariantMap      _cache;              // validators and digests of the manifests of the installed version, and stat record of its files
+    QVariantMap      _manifestValidators; // same for the manifests received during this check, saved with the installed version
+    QString          _onlineDigest;       // base64 sha1 of the online version json as published, empty if unknown
+    VerificationSnapshot* _snapshot;
+    
+    StaleFilesPolicy _staleFilesPolicy;
+    QStringList      _staleFilesWhitelist;
+    QStringList      _staleFilesBlacklist;
+    QStringList      _staleFiles;
+    
+    QStringList      _coreFiles;
+    QSet<int>        _lazyFiles;        // known but not present
+    QSet<int>        _fetchingFiles;
+    QSet<int>        _unavailableFiles; // skipped by the prefetcher
+    int              _prefetchSlots;
+    
+    QHash<QString, int> _pendingPatches;  // patch file -> patched file
+    
+    QTimer*          _pollTimer;
+    bool             _staging;            // a poll is checking or staging the online version
+    QString          _stagingPrefix;      // staging/<version>/ while staging, prepended to the download folders
+    RollbackStore*   _rollback;
+    
+    InstanceLock*    _lock;
+    
+    QPointer<QThread> _verifier;
+    std::atomic<bool> _canceled;
+    int               _verification;      // incremented when the results of a running verifier become obsolete
 };
 
 #endif // VERSIONUPDATER_H
@@ -25,11 +25,15 @@ int main(int argc, char *argv[])
         QStringList dataFiles = VersionUpdater::parseAppFolder({"data.*"});
         QByteArray versionJson = VersionUpdater::generateVersionJson(dataFiles, exeFiles);
         
-        // save json
-        QFile file("version.json");
-        file.open(QFile::WriteOnly);
-        file.write(versionJson);
-        return 0;
+        // binary patches from the previous releases given after the option
+        QStringList previousReleaseDirs = a.arguments().mid(a.arguments().indexOf("makeVersion") + 1);
+        if(!previousReleaseDirs.isEmpty())
+            versionJson = VersionUpdater::generatePatches(versionJson, previousReleaseDirs);
+        if(versionJson.isEmpty())
+            return 1;
+        
+        // save json, along with the diff from the previously generated version
+        return VersionUpdater::publishVersionJson(versionJson) ? 0 : 1;
     }
     
     MainWindow mainwindow;
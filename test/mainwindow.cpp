@@ -26,6 +26,10 @@ MainWindow::MainWindow(QWidget *parent) :
     
     QObject::connect(_updater, &VersionUpdater::failure,         this, &MainWindow::onError);
     QObject::connect(_updater, &VersionUpdater::progressChanged, this, &MainWindow::onProgress);
+    QObject::connect(_progress, &QProgressDialog::canceled, this, [this](){
+        _updater->cancelUpdate();
+        finished(false);
+    });
     
     // default updater
     // _updater->updateApplication();
@@ -72,13 +76,14 @@ void MainWindow::customUpdate()
             {
                 // ask for confirmation
                 qint64 size = 0;
-                for(auto it : _updater->filesToUpdate())
-                    size += it.second;
+                for(int i : _updater->missingFiles())
+                    size += _updater->onlineManifest().fileSize(i);
                 QString infoStr = tr("An update is available %1 => %2 \nDo you want to download the update ? (size = %3 bytes)");
                 infoStr = infoStr.arg(qApp->applicationVersion()).arg(version).arg(size);
                 getUpdate = (QMessageBox::question(nullptr, tr("Update available"), infoStr) == QMessageBox::Yes);
                 if(!getUpdate)
                 {
+                    _updater->cancelUpdate(); // releases the folder for the other instances
                     finished(false);
                     return;
                 }
@@ -94,6 +99,16 @@ void MainWindow::customUpdate()
             finished(true);
     });
     
+    // another instance of the app is updating the folder, its progress is shown until it is done
+    connect(_updater, &VersionUpdater::otherInstanceUpdating, this, [this](){
+        _progress->setLabelText(tr("Another instance is updating the application..."));
+    });
+    
+    connect(_updater, &VersionUpdater::otherInstanceFinished, this, [this](bool){
+        _progress->setLabelText(tr("Checking for updates..."));
+        _updater->getOnlineVersionInfo();
+    });
+    
     connect(_updater, &VersionUpdater::allFilesDownloaded, this, [this](){
         _updater->applyDataPatch();
         if(_updater->restartRequired())